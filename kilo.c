@@ -4,21 +4,40 @@
 
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <signal.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_HL_CHUNK_ROWS 1024
+#define KILO_HL_MAX_THREADS 64
+#define KILO_HL_SLICE_ROWS 1024
+#define KILO_SWAP_INTERVAL 2000
+#define KILO_FOLLOW_CHUNK (4 * 1024 * 1024)
+#define KILO_PAGER_STRIDE 1024
+#define KILO_CACHE_BUDGET 256
+#define KILO_PAGER_SLICE (16 * 1024 * 1024)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -59,16 +78,282 @@ enum editorHighlight {
     HL_MATCH
 };
 
+enum editorRowHlState {
+    ROW_HL_PENDING = 0,
+    ROW_HL_GUESSED,
+    ROW_HL_READY
+};
+
 typedef struct erow {
     int idx;
     int size;
     int rsize;
     char *chars;
     char *render;
+    int rwidth;
+    unsigned char *cw;
     unsigned char *hl;
     int hl_open_comment;
+    int hl_state;
+    int isize;
+    int vlines;
+    int *refs;
 } erow;
 
+/* Rows held outside the buffer, by the kill ring and the undo log. Each
+ * row shares chars, render and cw with the rows it was taken from; refs
+ * counts the erows pointing at that text and is NULL while a row owns it
+ * alone. A shared row is copied only when something edits it. */
+struct rowSlice {
+    int refs;
+    int nrows;
+    erow *rows;
+};
+
+#define KILO_INDEX_BLOCK 256
+
+/* Cumulative index over a per-row metric. Rows are grouped into blocks of
+ * about KILO_INDEX_BLOCK; Fenwick trees over the per-block row counts and
+ * metric sums make locating a row or an offset O(log n) plus a scan of one
+ * block, and an edit touches one block. Blocks that grow too large from
+ * inserts drop the index, which is rebuilt on the next lookup. */
+struct rowIndex {
+    int valid;
+    int nblocks;
+    int nrows;
+    int cap;
+    int *rows;
+    long long *sums;
+    int *trows;
+    long long *tsums;
+    long long (*metric)(erow *row);
+};
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Log-linear histogram in the style of HdrHistogram: each power of two is
+ * split into HIST_SUB buckets, so values keep ~3% relative precision. */
+struct histogram {
+    long long count;
+    long long max;
+    unsigned int buckets[HIST_BUCKETS];
+};
+
+enum editorStat {
+    STAT_KEY = 0,
+    STAT_SYNTAX,
+    STAT_HL_SLICE,
+    STAT_FIND,
+    STAT_SAVE,
+    STAT_FRAME_BYTES,
+    STAT_COUNT
+};
+
+struct editorStats {
+    int enabled;
+    char *dumpfile;
+    struct histogram hist[STAT_COUNT];
+    long long mallocs;
+    long long reallocs;
+    long long bytes;
+    long long key_time;
+    int frames;
+};
+
+/* An op and its inverse differ only in the low bit. */
+enum undoOpType {
+    UNDO_INSERT_TEXT = 0,
+    UNDO_DELETE_TEXT,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW,
+    UNDO_INSERT_ROWS,
+    UNDO_DELETE_ROWS
+};
+
+struct undoOp {
+    unsigned char type;
+    unsigned char reversed;
+    int group;
+    int row;
+    int col;
+    int len;
+    size_t text;
+    struct rowSlice *rows;
+};
+
+/* Append-only edit journal. ops[0, nops) can be undone and ops[nops, top)
+ * redone. Op text lives back to back in a bump-allocated arena, so a run
+ * of typed or deleted characters extends the last op in place. Bulk row
+ * ops keep a reference to a rowSlice instead, with the row count in col. */
+struct undoLog {
+    struct undoOp *ops;
+    int nops;
+    int top;
+    int capacity;
+    char *arena;
+    size_t used;
+    size_t size;
+    int group;
+    int clean;
+    int suspended;
+};
+
+struct swapHeader {
+    char magic[8];
+    long long size;
+    long long mtime;
+};
+
+/* Crash-recovery journal: row edits are queued in pending and appended to
+ * the swap file every interval milliseconds. Records replay on top of the
+ * file as it was on disk when the swap header was written. */
+struct editorSwap {
+    char *path;
+    int fd;
+    int interval;
+    int suspended;
+    char *pending;
+    size_t len;
+    size_t cap;
+    long long last_flush;
+};
+
+struct editorFollow {
+    int enabled;
+    int ifd;
+    int fd;
+    off_t offset;
+    int partial;
+    int behind;
+};
+
+/* Read-only view of a mapped file. index[k] is the byte offset of line
+ * k * KILO_PAGER_STRIDE; it is filled in by a background thread and only
+ * read or extended under E.lock. */
+struct editorPager {
+    int enabled;
+    int fd;
+    char *map;
+    size_t size;
+    size_t top;
+    long long *index;
+    int nindex;
+    int capindex;
+    long long lines;
+    size_t indexed;
+    int done;
+    pthread_t thread;
+    char *query;
+};
+
+struct grepResult {
+    char *path;
+    int line;
+    int col;
+    char *text;
+};
+
+struct grepQueue {
+    pthread_mutex_t lock;
+    char **items;
+    int head;
+    int tail;
+    int cap;
+};
+
+/* Project search state. Queue entries are paths prefixed with 'd' for a
+ * directory or 'f' for a file; results are appended under lock. */
+struct editorGrep {
+    int active;
+    int running;
+    int cancel;
+    char *query;
+    size_t qlen;
+    pthread_mutex_t lock;
+    struct grepResult *results;
+    int nresults;
+    int cap;
+    int files;
+    int shown;
+    int sel;
+    int top;
+    int pending;
+    int nthreads;
+    pthread_t threads[KILO_HL_MAX_THREADS];
+    struct grepQueue queues[KILO_HL_MAX_THREADS];
+    long long start;
+    long long elapsed;
+};
+
+struct editorBlock {
+    int active;
+    int row;
+    int rx;
+};
+
+struct editorMark {
+    int active;
+    int row;
+    int col;
+};
+
+#define KILO_KILL_RING 16
+
+/* A killed region: head is the text up to the end of its first line.
+ * Multi-line regions also have the full lines in between, as shared rows,
+ * and tail, the start of the last line; tail is NULL for a single line. */
+struct killEntry {
+    char *head;
+    int headlen;
+    struct rowSlice *rows;
+    char *tail;
+    int taillen;
+};
+
+struct editorKill {
+    struct killEntry ring[KILO_KILL_RING];
+    int count;
+    int newest;
+    int yank;
+    int yank_group;
+    int yank_row;
+    int yank_col;
+};
+
+struct editorBench {
+    long long start;
+    long long opened;
+};
+
+/* Per-file state. The active buffer's fields live in E, where the rest of
+ * the editor works on them; editorBufferSwitch stores them back here and
+ * loads the next buffer. cache counts the bytes of render, width and
+ * highlight data held by the buffer's rows. */
+struct editorBuffer {
+    int cx, cy;
+    int rx;
+    int rowoff;
+    int coloff;
+    int numrows;
+    int rowcap;
+    erow *row;
+    int dirty;
+    char *filename;
+    struct editorSyntax *syntax;
+    int hl_next;
+    int wrapoff;
+    int wrapcols;
+    struct undoLog undo;
+    struct editorSwap swap;
+    struct rowIndex bytes;
+    struct rowIndex vlines;
+    long long last_used;
+    size_t cache;
+    int evicted;
+};
+
 struct editorConfig {
     int cx, cy;
     int rx;
@@ -77,17 +362,61 @@ struct editorConfig {
     int screenrows;
     int screencols;
     int numrows;
+    int rowcap;
     erow *row;
     int dirty;
     char *filename;
-    char statusmsg[80];
+    char statusmsg[256];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
     struct termios orig_termios;
+    pthread_mutex_t lock;
+    pthread_cond_t hl_cond;
+    pthread_t hl_thread;
+    int lock_waiters;
+    int hl_next;
+    int redraw;
+    int infd;
+    int headless;
+    struct editorStats stats;
+    struct editorBench bench;
+    struct undoLog undo;
+    struct editorSwap swap;
+    struct editorFollow follow;
+    struct editorPager pager;
+    struct rowIndex bytes;
+    int wrap;
+    int wrapoff;
+    int wrapcols;
+    struct rowIndex vlines;
+    volatile sig_atomic_t resized;
+    struct editorGrep grep;
+    struct editorBlock block;
+    struct editorMark mark;
+    struct editorKill kill;
+    struct editorBuffer *buffers;
+    int nbuffers;
+    int current;
+    size_t cache_budget;
+    int batch;
+    int batch_lo;
+    int batch_hi;
 };
 
 struct editorConfig E;
 
+/* Allocations the editor makes for its own data; they are counted for
+ * the stats table when stats are on. */
+void *editorMalloc(size_t size) {
+    if (E.stats.enabled) __atomic_add_fetch(&E.stats.mallocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *editorRealloc(void *ptr, size_t size) {
+    if (E.stats.enabled) __atomic_add_fetch(&E.stats.reallocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL };
 char *C_HL_keywords[] = {
     "switch", "if", "while", "for", "break", "continue", "return", "else",
@@ -112,14 +441,128 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorSwapFlush(int force);
+void editorFollowPoll();
+void editorGrepPoll();
+void editorHandleResize();
+
+long long editorNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void editorWrite(const char *buf, int len) {
+    E.stats.bytes += len;
+    if (E.headless) return;
+    write(STDOUT_FILENO, buf, len);
+}
 
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    editorWrite("\x1b[2J", 4);
+    editorWrite("\x1b[H", 3);
     perror(s);
     exit(1);
 }
 
+int histIndex(long long v) {
+    if (v < HIST_SUB) return v < 0 ? 0 : v;
+    int shift = (63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+long long histValue(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int shift = idx / HIST_SUB - 1;
+    long long sub = idx % HIST_SUB;
+    return ((HIST_SUB + sub) << shift) + ((1LL << shift) >> 1);
+}
+
+void histRecord(struct histogram *h, long long v) {
+    h->buckets[histIndex(v)]++;
+    h->count++;
+    if (v > h->max) h->max = v;
+}
+
+long long histPercentile(struct histogram *h, double pct) {
+    long long want = (long long)(pct / 100 * h->count + 0.5);
+    long long seen = 0;
+    if (want < 1) want = 1;
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= want) return histValue(j) < h->max ? histValue(j) : h->max;
+    }
+    return h->max;
+}
+
+long long editorStatsBegin() {
+    return E.stats.enabled ? editorNow() : 0;
+}
+
+void editorStatsEnd(int stat, long long start) {
+    if (start) histRecord(&E.stats.hist[stat], editorNow() - start);
+}
+
+void editorStatsKeyDone() {
+    if (E.stats.key_time == 0) return;
+    histRecord(&E.stats.hist[STAT_KEY], editorNow() - E.stats.key_time);
+    E.stats.key_time = 0;
+}
+
+char *formatNs(char *buf, size_t size, struct histogram *h, double pct) {
+    long long ns = histPercentile(h, pct);
+    if (h->count == 0) snprintf(buf, size, "-");
+    else if (ns < 10000) snprintf(buf, size, "%lldns", ns);
+    else if (ns < 10000000) snprintf(buf, size, "%lldus", ns / 1000);
+    else snprintf(buf, size, "%lldms", ns / 1000000);
+    return buf;
+}
+
+void editorStatsDump(FILE *fp) {
+    static const char *names[STAT_COUNT] = {
+        "key", "syntax", "hl-slice", "find", "save", "frame-bytes"
+    };
+    double pct[] = {50, 90, 99, 99.9};
+
+    fprintf(fp, "%-12s %10s", "event", "count");
+    for (unsigned int j = 0; j < sizeof(pct) / sizeof(pct[0]); j++) fprintf(fp, " %9s%g", "p", pct[j]);
+    fprintf(fp, " %10s\n", "max");
+    for (int k = 0; k < STAT_COUNT; k++) {
+        struct histogram *h = &E.stats.hist[k];
+        double div = (k == STAT_FRAME_BYTES) ? 1 : 1000;
+        if (h->count == 0) continue;
+        fprintf(fp, "%-12s %10lld", names[k], h->count);
+        for (unsigned int j = 0; j < sizeof(pct) / sizeof(pct[0]); j++)
+            fprintf(fp, " %10.1f", histPercentile(h, pct[j]) / div);
+        fprintf(fp, " %10.1f\n", h->max / div);
+    }
+    fprintf(fp, "times in us, frame-bytes in bytes\n");
+    fprintf(fp, "frames: %d  bytes written: %lld  malloc: %lld  realloc: %lld\n",
+            E.stats.frames, E.stats.bytes, E.stats.mallocs, E.stats.reallocs);
+}
+
+void editorStatsAtExit() {
+    FILE *fp = fopen(E.stats.dumpfile, "w");
+    if (!fp) return;
+    editorStatsDump(fp);
+    fclose(fp);
+}
+
+void editorBenchReport() {
+    printf("open: %.2f ms\n", (E.bench.opened - E.bench.start) / 1e6);
+    editorStatsDump(stdout);
+}
+
+void editorLock() {
+    __atomic_add_fetch(&E.lock_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&E.lock);
+    __atomic_sub_fetch(&E.lock_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+void editorUnlock() {
+    pthread_mutex_unlock(&E.lock);
+}
+
 void disableRawMode() {
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
 }
@@ -142,19 +585,40 @@ void enableRawMode() {
 int editorReadKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+    editorStatsKeyDone();
+    if (E.headless && E.bench.opened == 0) E.bench.opened = editorNow();
+    editorSwapFlush(0);
+    editorFollowPoll();
+    while (1) {
+        editorUnlock();
+        nread = read(E.infd, &c, 1);
+        editorLock();
+        if (nread == 1) break;
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+        if (nread == 0 && E.headless) {
+            editorBenchReport();
+            exit(0);
+        }
+        editorFollowPoll();
+        editorGrepPoll();
+        if (E.resized) editorHandleResize();
+        if (E.redraw) {
+            E.redraw = 0;
+            editorRefreshScreen();
+        }
+        editorSwapFlush(0);
     }
+    if (E.stats.enabled) E.stats.key_time = editorNow();
 
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (read(E.infd, &seq[0], 1) != 1) return '\x1b';
+        if (read(E.infd, &seq[1], 1) != 1) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (read(E.infd, &seq[2], 1) != 1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
@@ -185,7 +649,7 @@ int editorReadKey() {
 
         return '\x1b';
     } else {
-        return c;
+        return (unsigned char)c;
     }
 
 }
@@ -223,12 +687,127 @@ int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
+struct interval {
+    int first;
+    int last;
+};
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
+const struct interval combining[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x0900, 0x0902}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+    {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+};
+
+const struct interval wide[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x2614, 0x2615}, {0x2648, 0x2653}, {0x26A1, 0x26A1}, {0x26BD, 0x26BE},
+    {0x26C4, 0x26C5}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x2753, 0x2755}, {0x2757, 0x2757},
+    {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+    {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int inTable(int cp, const struct interval *table, int n) {
+    int lo = 0, hi = n - 1;
+    if (cp < table[0].first || cp > table[hi].last) return 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp > table[mid].last) lo = mid + 1;
+        else if (cp < table[mid].first) hi = mid - 1;
+        else return 1;
+    }
+    return 0;
+}
+
+int utf8CharWidth(int cp) {
+    if (inTable(cp, combining, sizeof(combining) / sizeof(combining[0]))) return 0;
+    if (inTable(cp, wide, sizeof(wide) / sizeof(wide[0]))) return 2;
+    return 1;
+}
+
+/* Decodes one UTF-8 sequence from s. Returns its length in bytes, or -1 if
+ * the bytes at s do not form a valid, shortest-form sequence. */
+int utf8Decode(const char *s, int len, int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int n, c;
+
+    if (len <= 0) return -1;
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+        n = 2; c = u[0] & 0x1F;
+    } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+        n = 3; c = u[0] & 0x0F;
+    } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+        n = 4; c = u[0] & 0x07;
+    } else {
+        return -1;
+    }
+    if (len < n) return -1;
+
+    for (int i = 1; i < n; i++) {
+        if ((u[i] & 0xC0) != 0x80) return -1;
+        c = (c << 6) | (u[i] & 0x3F);
+    }
+    if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+        (n == 4 && (c < 0x10000 || c > 0x10FFFF))) return -1;
+
+    *cp = c;
+    return n;
+}
+
+int utf8PrevChar(const char *s, int at) {
+    int i = at - 1;
+    while (i > 0 && at - i < 4 && ((unsigned char)s[i] & 0xC0) == 0x80) i--;
+    int cp;
+    if (utf8Decode(&s[i], at - i, &cp) != at - i) return at - 1;
+    return i;
+}
+
+int utf8NextChar(const char *s, int len, int at) {
+    int cp;
+    int n = utf8Decode(&s[at], len - at, &cp);
+    return at + (n > 0 ? n : 1);
+}
+
+int utf8ClipWidth(const char *s, int len, int cols) {
+    int width = 0;
+    int i = 0;
+    while (i < len) {
+        int cp, w;
+        int n = utf8Decode(&s[i], len - i, &cp);
+        if (n < 0) {
+            n = 1;
+            w = 1;
+        } else {
+            w = utf8CharWidth(cp);
+        }
+        if (width + w > cols) break;
+        width += w;
+        i += n;
+    }
+    return i;
+}
+
+
+int editorHighlightRow(erow *row, int in_comment) {
+    row->hl = editorRealloc(row->hl, row->rsize + 1);
     memset(row->hl, HL_NORMAL, row->rsize);
 
-    if (E.syntax == NULL) return;
+    if (E.syntax == NULL) return 0;
 
     char **keywords = E.syntax->keywords;
 
@@ -242,11 +821,10 @@ void editorUpdateSyntax(erow *row) {
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
 
     int i = 0;
     while (i < row->rsize) {
-        char c = row->render[i];
+        unsigned char c = row->render[i];
         unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
 
         if (scs_len && !in_string && !in_comment) {
@@ -318,7 +896,7 @@ void editorUpdateSyntax(erow *row) {
                 if (kw2) klen--;
 
                 if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
+                    is_separator((unsigned char)row->render[i + klen])) {
                     memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
                     i += klen;
                     break;
@@ -334,9 +912,178 @@ void editorUpdateSyntax(erow *row) {
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows) editorUpdateSyntax(&E.row[row->idx + 1]);
+    return in_comment;
+}
+
+void editorHighlightGuess(erow *row) {
+    erow *prev = (row->idx > 0) ? &E.row[row->idx - 1] : NULL;
+    row->hl_open_comment = editorHighlightRow(row, prev && prev->hl_open_comment);
+    row->hl_state = (!prev || prev->hl_state == ROW_HL_READY) ? ROW_HL_READY : ROW_HL_GUESSED;
+}
+
+void editorUpdateSyntax(erow *row) {
+    long long start = editorStatsBegin();
+    while (1) {
+        int prev_open = row->hl_open_comment;
+        editorHighlightGuess(row);
+        if (row->hl_state != ROW_HL_READY) pthread_cond_signal(&E.hl_cond);
+        if (row->hl_open_comment == prev_open || row->idx + 1 >= E.numrows) break;
+        row = &E.row[row->idx + 1];
+        if (row->hl_state != ROW_HL_READY) break;
+    }
+    editorStatsEnd(STAT_SYNTAX, start);
+}
+
+struct hlChunk {
+    int start;
+    int end;
+    int in_comment;
+};
+
+struct hlPool {
+    pthread_mutex_t lock;
+    struct hlChunk *chunks;
+    int nchunks;
+    int next;
+};
+
+void editorHighlightChunk(struct hlChunk *chunk) {
+    int in_comment = chunk->in_comment;
+    for (int j = chunk->start; j < chunk->end; j++) {
+        in_comment = editorHighlightRow(&E.row[j], in_comment);
+        E.row[j].hl_open_comment = in_comment;
+        E.row[j].hl_state = ROW_HL_READY;
+    }
+}
+
+void *editorHighlightWorker(void *arg) {
+    struct hlPool *pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int k = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (k >= pool->nchunks) break;
+        editorHighlightChunk(&pool->chunks[k]);
+    }
+    return NULL;
+}
+
+int editorHighlightThreads() {
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > KILO_HL_MAX_THREADS) nthreads = KILO_HL_MAX_THREADS;
+    return nthreads;
+}
+
+/* Highlights rows [start, end) on a thread pool. Every chunk but the first
+ * is lexed assuming it starts outside a multi-line comment; the fix-up pass
+ * then re-lexes each wrongly-started chunk only until its state converges.
+ * Row start - 1 must already be ROW_HL_READY. Unless row end - 1 was READY
+ * already, its old state is not what row end was lexed against, so row
+ * end is always re-checked. */
+void editorHighlightRows(int start, int end) {
+    if (end > E.numrows) end = E.numrows;
+    if (start >= end) return;
+    int prev_open = (E.row[end - 1].hl_state == ROW_HL_READY) ? E.row[end - 1].hl_open_comment : -1;
+
+    int nthreads = editorHighlightThreads();
+    int nchunks = nthreads * 4;
+    if (nchunks > (end - start) / KILO_HL_CHUNK_ROWS) nchunks = (end - start) / KILO_HL_CHUNK_ROWS;
+    if (nchunks < 1) nchunks = 1;
+    if (nthreads > nchunks) nthreads = nchunks;
+
+    struct hlPool pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.chunks = editorMalloc(sizeof(struct hlChunk) * nchunks);
+    pool.nchunks = nchunks;
+    pool.next = 0;
+
+    int per = (end - start) / nchunks;
+    for (int k = 0; k < nchunks; k++) {
+        pool.chunks[k].start = start + k * per;
+        pool.chunks[k].end = (k == nchunks - 1) ? end : start + (k + 1) * per;
+        pool.chunks[k].in_comment = (k == 0 && start > 0) ? E.row[start - 1].hl_open_comment : 0;
+    }
+
+    pthread_t threads[KILO_HL_MAX_THREADS];
+    int spawned = 0;
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[spawned], NULL, editorHighlightWorker, &pool) == 0) spawned++;
+    }
+    editorHighlightWorker(&pool);
+    for (int t = 0; t < spawned; t++) pthread_join(threads[t], NULL);
+
+    for (int k = 1; k < nchunks; k++) {
+        int in_comment = E.row[pool.chunks[k].start - 1].hl_open_comment;
+        if (!in_comment) continue;
+        for (int j = pool.chunks[k].start; j < pool.chunks[k].end; j++) {
+            int open = editorHighlightRow(&E.row[j], in_comment);
+            int changed = (E.row[j].hl_open_comment != open);
+            E.row[j].hl_open_comment = open;
+            in_comment = open;
+            if (!changed) break;
+        }
+    }
+
+    free(pool.chunks);
+    pthread_mutex_destroy(&pool.lock);
+
+    if (E.row[end - 1].hl_open_comment != prev_open && end < E.numrows &&
+        E.row[end].hl_state == ROW_HL_READY)
+        E.row[end].hl_state = ROW_HL_GUESSED;
+}
+
+int editorHighlightViewport() {
+    int did = 0;
+    int end = E.rowoff + E.screenrows;
+    if (end > E.numrows) end = E.numrows;
+    for (int j = E.rowoff; j < end; j++) {
+        if (E.row[j].hl_state != ROW_HL_PENDING) continue;
+        editorHighlightGuess(&E.row[j]);
+        did = 1;
+    }
+    return did;
+}
+
+/* Background highlighter: rows on screen are lexed first, using the state
+ * of the row above as a guess, then the whole buffer is lexed in file
+ * order in slices, re-lexing guessed rows with their real incoming state.
+ * Rows before E.hl_next are always ROW_HL_READY. A slice is one chunk per
+ * core, so the lock is held for about one chunk's worth of lexing. */
+void *editorHighlightThread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&E.lock);
+    while (1) {
+        while (E.hl_next < E.numrows && E.row[E.hl_next].hl_state == ROW_HL_READY) E.hl_next++;
+        if (E.hl_next >= E.numrows) {
+            pthread_cond_wait(&E.hl_cond, &E.lock);
+            continue;
+        }
+
+        if (editorHighlightViewport()) {
+            E.redraw = 1;
+        } else {
+            int start = E.hl_next;
+            int end = start + KILO_HL_SLICE_ROWS * editorHighlightThreads();
+            if (end > E.numrows) end = E.numrows;
+            long long t0 = editorStatsBegin();
+            editorHighlightRows(start, end);
+            editorStatsEnd(STAT_HL_SLICE, t0);
+            E.hl_next = end;
+            if (start < E.rowoff + E.screenrows && end > E.rowoff) E.redraw = 1;
+        }
+
+        pthread_mutex_unlock(&E.lock);
+        while (__atomic_load_n(&E.lock_waiters, __ATOMIC_SEQ_CST)) sched_yield();
+        pthread_mutex_lock(&E.lock);
+    }
+    return NULL;
+}
+
+void editorInvalidateSyntax() {
+    for (int j = 0; j < E.numrows; j++) E.row[j].hl_state = ROW_HL_PENDING;
+    E.hl_next = 0;
+    pthread_cond_signal(&E.hl_cond);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -366,11 +1113,7 @@ void editorSelectSyntaxHighlight() {
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
                 E.syntax = s;
-
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+                editorInvalidateSyntax();
 
                 return;
             }
@@ -379,130 +1122,764 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
+int editorRowCharWidth(erow *row, int at, int rx, int *len) {
+    int cp;
+    *len = 1;
+    if (row->chars[at] == '\t') return KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+    if (row->cw == NULL) return 1;
+
+    int n = utf8Decode(&row->chars[at], row->size - at, &cp);
+    if (n < 0) return 1;
+    *len = n;
+    return utf8CharWidth(cp);
+}
+
 int editorRowCxToRx(erow *row, int cx) {
     int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        }
-        rx++;
+    int j = 0;
+    while (j < cx) {
+        int len;
+        rx += editorRowCharWidth(row, j, rx, &len);
+        j += len;
     }
     return rx;
 }
 
+/* Display column of byte j of the render. */
+int editorRenderToRx(erow *row, int j) {
+    if (row->cw == NULL) return j;
+    int rx = 0;
+    for (int k = 0; k < j; k += row->cw[k] >> 2) rx += row->cw[k] & 3;
+    return rx;
+}
+
 int editorRowRxToCx(erow *row, int rx) {
     int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        }
-        cur_rx++;
+    int cx = 0;
+    while (cx < row->size) {
+        int len;
+        cur_rx += editorRowCharWidth(row, cx, cur_rx, &len);
         if (cur_rx > rx) return cx;
+        cx += len;
     }
 
     return cx;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') tabs++;
+void editorRowShare(erow *dst, erow *src) {
+    if (src->refs == NULL) {
+        src->refs = editorMalloc(sizeof(int));
+        *src->refs = 1;
     }
+    (*src->refs)++;
+    dst->chars = src->chars;
+    dst->size = src->size;
+    dst->render = src->render;
+    dst->rsize = src->rsize;
+    dst->rwidth = src->rwidth;
+    dst->cw = src->cw;
+    dst->refs = src->refs;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+/* Gives the row its own copy of chars before an edit. The render is
+ * dropped rather than copied, as the edit rebuilds it anyway. */
+void editorRowUnshare(erow *row) {
+    if (row->refs == NULL) return;
+    if (--*row->refs == 0) {
+        free(row->refs);
+        row->refs = NULL;
+        return;
+    }
+    char *chars = editorMalloc(row->size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+    row->render = NULL;
+    row->rsize = 0;
+    row->cw = NULL;
+    row->refs = NULL;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while(idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+void editorRowRelease(erow *row) {
+    if (row->refs == NULL || --*row->refs == 0) {
+        free(row->refs);
+        free(row->chars);
+        free(row->render);
+        free(row->cw);
     }
+    row->refs = NULL;
+    row->chars = NULL;
+    row->render = NULL;
+    row->cw = NULL;
+}
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+struct rowSlice *editorSliceNew(int nrows) {
+    struct rowSlice *s = editorMalloc(sizeof(struct rowSlice));
+    s->refs = 1;
+    s->nrows = nrows;
+    s->rows = editorMalloc(sizeof(erow) * (nrows ? nrows : 1));
+    memset(s->rows, 0, sizeof(erow) * nrows);
+    return s;
+}
 
-    editorUpdateSyntax(row);
+/* A slice sharing the text of rows [at, at + nrows). */
+struct rowSlice *editorSliceCopy(int at, int nrows) {
+    struct rowSlice *s = editorSliceNew(nrows);
+    for (int k = 0; k < nrows; k++) editorRowShare(&s->rows[k], &E.row[at + k]);
+    return s;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+void editorSliceRelease(struct rowSlice *s) {
+    if (s == NULL || --s->refs > 0) return;
+    for (int k = 0; k < s->nrows; k++) editorRowRelease(&s->rows[k]);
+    free(s->rows);
+    free(s);
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+void undoArenaAppend(struct undoLog *u, const char *s, int len, int reversed) {
+    if (len == 0) return;
+    if (u->used + len > u->size) {
+        while (u->used + len > u->size) u->size = u->size ? u->size * 2 : 4096;
+        u->arena = editorRealloc(u->arena, u->size);
+    }
+    if (reversed) {
+        for (int j = 0; j < len; j++) u->arena[u->used + j] = s[len - 1 - j];
+    } else {
+        memcpy(&u->arena[u->used], s, len);
+    }
+    u->used += len;
+}
 
-    E.row[at].idx = at;
+int undoExtend(struct undoLog *u, int type, int row, int col, const char *s, int len) {
+    if (u->nops == 0) return 0;
+    struct undoOp *last = &u->ops[u->nops - 1];
+    if (last->type != type || last->row != row || last->group < u->group - 1) return 0;
+    if (last->text + last->len != u->used) return 0;
+
+    if (type == UNDO_INSERT_TEXT && !last->reversed && col == last->col + last->len) {
+        undoArenaAppend(u, s, len, 0);
+    } else if (type == UNDO_DELETE_TEXT && !last->reversed && col == last->col) {
+        undoArenaAppend(u, s, len, 0);
+    } else if (type == UNDO_DELETE_TEXT && col + len == last->col) {
+        if (!last->reversed) {
+            char *t = &u->arena[last->text];
+            for (int i = 0, j = last->len - 1; i < j; i++, j--) {
+                char c = t[i];
+                t[i] = t[j];
+                t[j] = c;
+            }
+            last->reversed = 1;
+        }
+        undoArenaAppend(u, s, len, 1);
+        last->col = col;
+    } else {
+        return 0;
+    }
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    last->len += len;
+    last->group = u->group;
+    if (u->clean == u->nops) u->clean = -1;
+    return 1;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+/* Drops the redo tail before a new op is recorded. */
+void undoTruncate(struct undoLog *u) {
+    if (u->top <= u->nops) return;
+    for (int j = u->nops; j < u->top; j++) editorSliceRelease(u->ops[j].rows);
+    u->top = u->nops;
+    u->used = u->nops ? u->ops[u->nops - 1].text + u->ops[u->nops - 1].len : 0;
+    if (u->clean > u->nops) u->clean = -1;
+}
 
-    E.numrows++;
-    E.dirty++;
+struct undoOp *undoPush(struct undoLog *u, int type, int row, int col, int len) {
+    if (u->nops == u->capacity) {
+        u->capacity = u->capacity ? u->capacity * 2 : 256;
+        u->ops = editorRealloc(u->ops, sizeof(struct undoOp) * u->capacity);
+    }
+    struct undoOp *op = &u->ops[u->nops++];
+    op->type = type;
+    op->reversed = 0;
+    op->group = u->group;
+    op->row = row;
+    op->col = col;
+    op->len = len;
+    op->text = u->used;
+    op->rows = NULL;
+    u->top = u->nops;
+    return op;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+void editorUndoRecord(int type, int row, int col, const char *s, int len) {
+    struct undoLog *u = &E.undo;
+    if (u->suspended) return;
+
+    undoTruncate(u);
+    if ((type == UNDO_INSERT_TEXT || type == UNDO_DELETE_TEXT) &&
+        undoExtend(u, type, row, col, s, len)) return;
+
+    undoPush(u, type, row, col, len);
+    undoArenaAppend(u, s, len, 0);
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at + 1; j <= E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+/* Records a bulk row op; the log takes its own reference to the slice. */
+void editorUndoRecordRows(int type, int row, struct rowSlice *rows) {
+    struct undoLog *u = &E.undo;
+    if (u->suspended) return;
+
+    undoTruncate(u);
+    rows->refs++;
+    undoPush(u, type, row, rows->nrows, 0)->rows = rows;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorSwapRecord(int type, int row, int col, const char *s, int len) {
+    struct editorSwap *sw = &E.swap;
+    if (sw->path == NULL || sw->suspended) return;
+
+    size_t need = 1 + 3 * sizeof(int) + len;
+    if (sw->len + need > sw->cap) {
+        while (sw->len + need > sw->cap) sw->cap = sw->cap ? sw->cap * 2 : 4096;
+        sw->pending = editorRealloc(sw->pending, sw->cap);
+    }
+    char *p = &sw->pending[sw->len];
+    *p++ = type;
+    memcpy(p, &row, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &col, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &len, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, s, len);
+    sw->len += need;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void editorJournal(int type, int row, int col, const char *s, int len) {
+    editorUndoRecord(type, row, col, s, len);
+    editorSwapRecord(type, row, col, s, len);
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
+void editorUndoReset() {
+    for (int j = 0; j < E.undo.top; j++) editorSliceRelease(E.undo.ops[j].rows);
+    E.undo.nops = 0;
+    E.undo.top = 0;
+    E.undo.used = 0;
+    E.undo.clean = 0;
+}
+
+void editorUpdateWidths(erow *row) {
+    int j;
+    for (j = 0; j < row->rsize; j++) {
+        if ((unsigned char)row->render[j] >= 0x80) break;
+    }
+    if (j == row->rsize) {
+        free(row->cw);
+        row->cw = NULL;
+        row->rwidth = row->rsize;
+        return;
+    }
+
+    row->cw = editorRealloc(row->cw, row->rsize);
+    memset(row->cw, 0, row->rsize);
+    row->rwidth = j;
+    memset(row->cw, (1 << 2) | 1, j);
+
+    while (j < row->rsize) {
+        int cp, w;
+        int n = utf8Decode(&row->render[j], row->rsize - j, &cp);
+        if (n < 0) {
+            n = 1;
+            w = 1;
+        } else {
+            w = utf8CharWidth(cp);
+        }
+        row->cw[j] = (n << 2) | w;
+        row->rwidth += w;
+        j += n;
+    }
+}
+
+void editorBatchTouch(int at) {
+    if (at < E.batch_lo) E.batch_lo = at;
+    if (at > E.batch_hi) E.batch_hi = at;
+}
+
+/* Between editorBatchBegin and editorBatchEnd rows only get their render
+ * rebuilt; the touched range is re-highlighted once at the end. */
+void editorBatchBegin() {
+    if (E.batch++ > 0) return;
+    E.batch_lo = INT_MAX;
+    E.batch_hi = -1;
+}
+
+void editorBatchEnd() {
+    if (--E.batch > 0 || E.batch_hi < 0) return;
+
+    int lo = E.batch_lo;
+    int hi = E.batch_hi < E.numrows ? E.batch_hi : E.numrows - 1;
+    if (lo >= E.numrows) return;
+    if (hi < lo) hi = lo;
+
+    if (hi - lo < KILO_HL_CHUNK_ROWS && (lo == 0 || E.row[lo - 1].hl_state == ROW_HL_READY)) {
+        editorHighlightRows(lo, hi + 1);
+        if (hi + 1 < E.numrows && E.row[hi + 1].hl_state == ROW_HL_GUESSED)
+            editorUpdateSyntax(&E.row[hi + 1]);
+    } else {
+        for (int j = lo; j <= hi; j++) E.row[j].hl_state = ROW_HL_PENDING;
+        if (lo < E.hl_next) E.hl_next = lo;
+        pthread_cond_signal(&E.hl_cond);
+    }
+}
+
+void rowIndexAdd(struct rowIndex *ix, int b, int rows, long long sum) {
+    ix->rows[b] += rows;
+    ix->sums[b] += sum;
+    ix->nrows += rows;
+    for (int i = b + 1; i <= ix->nblocks; i += i & -i) {
+        ix->trows[i] += rows;
+        ix->tsums[i] += sum;
+    }
+}
+
+void rowIndexReserve(struct rowIndex *ix, int n) {
+    if (n + 1 <= ix->cap) return;
+    while (n + 1 > ix->cap) ix->cap = ix->cap ? ix->cap * 2 : 64;
+    ix->rows = editorRealloc(ix->rows, sizeof(int) * ix->cap);
+    ix->sums = editorRealloc(ix->sums, sizeof(long long) * ix->cap);
+    ix->trows = editorRealloc(ix->trows, sizeof(int) * ix->cap);
+    ix->tsums = editorRealloc(ix->tsums, sizeof(long long) * ix->cap);
+}
+
+void rowIndexBuild(struct rowIndex *ix) {
+    int n = (E.numrows + KILO_INDEX_BLOCK - 1) / KILO_INDEX_BLOCK;
+    if (n == 0) n = 1;
+    rowIndexReserve(ix, n);
+    ix->nblocks = n;
+    ix->nrows = E.numrows;
+    for (int b = 0; b < n; b++) {
+        int first = b * KILO_INDEX_BLOCK;
+        int last = first + KILO_INDEX_BLOCK;
+        if (last > E.numrows) last = E.numrows;
+        ix->rows[b] = last > first ? last - first : 0;
+        ix->sums[b] = 0;
+        for (int j = first; j < last; j++) ix->sums[b] += ix->metric(&E.row[j]);
+        ix->trows[b + 1] = ix->rows[b];
+        ix->tsums[b + 1] = ix->sums[b];
+    }
+    for (int i = 1; i <= n; i++) {
+        int j = i + (i & -i);
+        if (j <= n) {
+            ix->trows[j] += ix->trows[i];
+            ix->tsums[j] += ix->tsums[i];
+        }
+    }
+    ix->valid = 1;
+}
+
+/* Walks down the trees to the block holding row (by_sum == 0) or metric
+ * offset pos (by_sum == 1). Returns the block and the rows and metric
+ * that come before it. */
+int rowIndexSeek(struct rowIndex *ix, long long pos, int by_sum, int *first, long long *before) {
+    int b = 0;
+    int step = 1;
+    *first = 0;
+    *before = 0;
+    while (step * 2 <= ix->nblocks) step *= 2;
+    for (; step > 0; step /= 2) {
+        int i = b + step;
+        if (i > ix->nblocks) continue;
+        long long v = by_sum ? ix->tsums[i] : ix->trows[i];
+        if (v <= pos) {
+            b = i;
+            pos -= v;
+            *first += ix->trows[i];
+            *before += ix->tsums[i];
+        }
+    }
+    return b;
+}
+
+void rowIndexInsert(struct rowIndex *ix, int at, long long value) {
+    if (!ix->valid) return;
+    int first;
+    long long before;
+    int b = rowIndexSeek(ix, at, 0, &first, &before);
+    if (b == ix->nblocks) {
+        b = ix->nblocks - 1;
+        if (ix->rows[b] >= KILO_INDEX_BLOCK) {
+            rowIndexReserve(ix, ix->nblocks + 1);
+            b = ix->nblocks++;
+            ix->rows[b] = 0;
+            ix->sums[b] = 0;
+            int lo = b + 1 - ((b + 1) & -(b + 1));
+            int r = 0;
+            long long s = 0;
+            for (int j = b; j > lo; j -= j & -j) {
+                r += ix->trows[j];
+                s += ix->tsums[j];
+            }
+            ix->trows[b + 1] = r;
+            ix->tsums[b + 1] = s;
+        }
+    }
+    if (ix->rows[b] >= KILO_INDEX_BLOCK * 4) {
+        ix->valid = 0;
+        return;
+    }
+    rowIndexAdd(ix, b, 1, value);
+}
+
+void rowIndexDelete(struct rowIndex *ix, int at, long long value) {
+    if (!ix->valid) return;
+    int first;
+    long long before;
+    rowIndexAdd(ix, rowIndexSeek(ix, at, 0, &first, &before), -1, -value);
+}
+
+void rowIndexUpdate(struct rowIndex *ix, int at, long long delta) {
+    if (!ix->valid || delta == 0) return;
+    int first;
+    long long before;
+    rowIndexAdd(ix, rowIndexSeek(ix, at, 0, &first, &before), 0, delta);
+}
+
+/* Metric that comes before row at. */
+long long rowIndexOffset(struct rowIndex *ix, int at) {
+    if (!ix->valid) rowIndexBuild(ix);
+    int first;
+    long long before;
+    rowIndexSeek(ix, at, 0, &first, &before);
+    for (int j = first; j < at && j < E.numrows; j++) before += ix->metric(&E.row[j]);
+    return before;
+}
+
+/* Row that contains metric offset pos; *rest is what is left of pos
+ * inside that row. Offsets past the end land on the last row. */
+int rowIndexFind(struct rowIndex *ix, long long pos, long long *rest) {
+    if (!ix->valid) rowIndexBuild(ix);
+    int first;
+    long long before;
+    rowIndexSeek(ix, pos, 1, &first, &before);
+    if (first >= E.numrows && E.numrows > 0) {
+        first = E.numrows - 1;
+        before -= ix->metric(&E.row[first]);
+    }
+    pos -= before;
+    int j;
+    for (j = first; j < E.numrows - 1; j++) {
+        long long m = ix->metric(&E.row[j]);
+        if (pos < m) break;
+        pos -= m;
+    }
+    *rest = pos;
+    return j;
+}
+
+long long editorRowBytes(erow *row) {
+    return row->isize + 1;
+}
+
+long long editorRowVisualLines(erow *row) {
+    return row->vlines;
+}
+
+/* Soft wrap splits a row's render into screen-wide segments, greedily, so
+ * a wide character that would straddle the edge starts the next segment.
+ * Returns where the segment starting at j ends and adds its width to *col. */
+int editorRowWrapNext(erow *row, int j, int *col) {
+    int width = 0;
+    if (row->cw == NULL) {
+        width = (row->rsize - j < E.screencols) ? row->rsize - j : E.screencols;
+        *col += width;
+        return j + width;
+    }
+    int start = j;
+    while (j < row->rsize) {
+        int w = row->cw[j] & 3;
+        if (width + w > E.screencols && j > start) break;
+        width += w;
+        j += row->cw[j] >> 2;
+    }
+    *col += width;
+    return j;
+}
+
+int editorRowWrapCount(erow *row) {
+    if (row->cw == NULL) {
+        if (row->rsize <= E.screencols) return 1;
+        return (row->rsize + E.screencols - 1) / E.screencols;
+    }
+    int n = 0, j = 0, col = 0;
+    do {
+        j = editorRowWrapNext(row, j, &col);
+        n++;
+    } while (j < row->rsize);
+    return n;
+}
+
+/* Segment of the row that holds column rx; *segcol is its first column. */
+int editorRowWrapSegment(erow *row, int rx, int *segcol) {
+    if (row->cw == NULL) {
+        int k = rx / E.screencols;
+        if (k >= row->vlines) k = row->vlines - 1;
+        *segcol = k * E.screencols;
+        return k;
+    }
+    int k = 0, j = 0, col = 0;
+    while (1) {
+        int start = col;
+        j = editorRowWrapNext(row, j, &col);
+        if (j >= row->rsize || rx < col) {
+            *segcol = start;
+            return k;
+        }
+        k++;
+    }
+}
+
+void editorRenderRow(erow *row) {
+    int tabs = 0;
+    int j;
+    editorRowUnshare(row);
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') tabs++;
+    }
+
+    free(row->render);
+    row->render = editorMalloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            while(idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+        } else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rsize = idx;
+
+    editorUpdateWidths(row);
+}
+
+void editorUpdateRow(erow *row) {
+    editorRenderRow(row);
+    rowIndexUpdate(&E.bytes, row->idx, row->size - row->isize);
+    row->isize = row->size;
+    int vlines = editorRowWrapCount(row);
+    rowIndexUpdate(&E.vlines, row->idx, vlines - row->vlines);
+    row->vlines = vlines;
+    if (E.batch) editorBatchTouch(row->idx);
+    else editorUpdateSyntax(row);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+    editorJournal(UNDO_INSERT_ROW, at, 0, s, len);
+    if (E.batch && at <= E.batch_hi) E.batch_hi++;
+
+    if (E.numrows == E.rowcap) {
+        E.rowcap = E.rowcap ? E.rowcap * 2 : 64;
+        E.row = editorRealloc(E.row, sizeof(erow) * E.rowcap);
+    }
+    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+
+    E.row[at].idx = at;
+
+    E.row[at].size = len;
+    E.row[at].chars = editorMalloc(len + 1);
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+
+    E.row[at].rsize = 0;
+    E.row[at].render = NULL;
+    E.row[at].rwidth = 0;
+    E.row[at].cw = NULL;
+    E.row[at].hl = NULL;
+    E.row[at].hl_open_comment = 0;
+    E.row[at].hl_state = ROW_HL_PENDING;
+    E.row[at].isize = len;
+    E.row[at].vlines = 1;
+    E.row[at].refs = NULL;
+
+    E.numrows++;
+    rowIndexInsert(&E.bytes, at, len + 1);
+    rowIndexInsert(&E.vlines, at, 1);
+    editorUpdateRow(&E.row[at]);
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+    editorRowRelease(row);
+    free(row->hl);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    editorJournal(UNDO_DELETE_ROW, at, 0, E.row[at].chars, E.row[at].size);
+    rowIndexDelete(&E.bytes, at, E.row[at].isize + 1);
+    rowIndexDelete(&E.vlines, at, E.row[at].vlines);
+    editorFreeRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+    E.numrows--;
+    E.dirty++;
+    if (at < E.hl_next) E.hl_next = at;
+    if (E.batch) {
+        if (at <= E.batch_hi) E.batch_hi--;
+        editorBatchTouch(at);
+    } else if (at < E.numrows && E.row[at].hl_state == ROW_HL_READY) {
+        editorUpdateSyntax(&E.row[at]);
+    }
+}
+
+/* Inserts the rows of a slice at at, sharing their text: one move of the
+ * rows below and no copies of chars or render. The new rows are
+ * highlighted once, as one batch. */
+void editorInsertRows(int at, struct rowSlice *rows) {
+    int n = rows->nrows;
+    if (at < 0 || at > E.numrows || n == 0) return;
+    editorUndoRecordRows(UNDO_INSERT_ROWS, at, rows);
+    for (int k = 0; k < n; k++)
+        editorSwapRecord(UNDO_INSERT_ROW, at + k, 0, rows->rows[k].chars, rows->rows[k].size);
+    editorBatchBegin();
+    if (at <= E.batch_hi) E.batch_hi += n;
+
+    if (E.numrows + n > E.rowcap) {
+        while (E.numrows + n > E.rowcap) E.rowcap = E.rowcap ? E.rowcap * 2 : 64;
+        E.row = editorRealloc(E.row, sizeof(erow) * E.rowcap);
+    }
+    memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+    for (int j = at + n; j < E.numrows + n; j++) E.row[j].idx += n;
+
+    int index = n < KILO_INDEX_BLOCK;
+    for (int k = 0; k < n; k++) {
+        erow *row = &E.row[at + k];
+        editorRowShare(row, &rows->rows[k]);
+        row->idx = at + k;
+        row->hl = NULL;
+        row->hl_open_comment = 0;
+        row->hl_state = ROW_HL_PENDING;
+        row->isize = row->size;
+        row->vlines = editorRowWrapCount(row);
+        if (index) {
+            rowIndexInsert(&E.bytes, at + k, row->isize + 1);
+            rowIndexInsert(&E.vlines, at + k, row->vlines);
+        }
+    }
+    E.numrows += n;
+    if (!index) {
+        E.bytes.valid = 0;
+        E.vlines.valid = 0;
+    }
+    E.dirty++;
+    if (at < E.hl_next) E.hl_next = at;
+    editorBatchTouch(at);
+    editorBatchTouch(at + n - 1);
+    editorBatchEnd();
+}
+
+/* Deletes rows [at, at + n) with one move of the rows below. Their text
+ * goes to the undo log as a slice rather than being copied or freed. */
+void editorDelRows(int at, int n) {
+    if (at < 0 || n <= 0 || at >= E.numrows) return;
+    if (n > E.numrows - at) n = E.numrows - at;
+    struct rowSlice *rows = E.undo.suspended ? NULL : editorSliceNew(n);
+    for (int k = 0; k < n; k++) editorSwapRecord(UNDO_DELETE_ROW, at, 0, "", 0);
+
+    int index = n < KILO_INDEX_BLOCK;
+    for (int k = 0; k < n; k++) {
+        erow *row = &E.row[at + k];
+        if (index) {
+            rowIndexDelete(&E.bytes, at, row->isize + 1);
+            rowIndexDelete(&E.vlines, at, row->vlines);
+        }
+        free(row->hl);
+        row->hl = NULL;
+        if (rows) rows->rows[k] = *row;
+        else editorRowRelease(row);
+    }
+    memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    for (int j = at; j < E.numrows - n; j++) E.row[j].idx -= n;
+    E.numrows -= n;
+    if (!index) {
+        E.bytes.valid = 0;
+        E.vlines.valid = 0;
+    }
+    if (rows) {
+        editorUndoRecordRows(UNDO_DELETE_ROWS, at, rows);
+        editorSliceRelease(rows);
+    }
+    E.dirty++;
+    if (at < E.hl_next) E.hl_next = at;
+    if (E.batch) {
+        if (at <= E.batch_hi) E.batch_hi = (E.batch_hi - n > at) ? E.batch_hi - n : at;
+        editorBatchTouch(at);
+    } else if (at < E.numrows && E.row[at].hl_state == ROW_HL_READY) {
+        editorUpdateSyntax(&E.row[at]);
+    }
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorJournal(UNDO_INSERT_TEXT, row->idx, at, s, len);
+    editorRowUnshare(row);
+    row->chars = editorRealloc(row->chars, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
     editorUpdateRow(row);
     E.dirty++;
 }
 
-void editorInsertChar(int c) {
+void editorRowInsertChar(erow *row, int at, int c) {
+    char ch = c;
+    editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowInsertString(row, row->size, s, len);
+}
+
+void editorRowDelString(erow *row, int at, int len) {
+    if (at < 0 || at >= row->size || len <= 0) return;
+    if (len > row->size - at) len = row->size - at;
+    editorJournal(UNDO_DELETE_TEXT, row->idx, at, &row->chars[at], len);
+    editorRowUnshare(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/* Replaces dellen bytes at at with s, journaling both halves, in one
+ * rewrite of the row. Callers account for dirty. */
+void editorRowSplice(erow *row, int at, int dellen, const char *s, int len) {
+    if (dellen > 0) editorJournal(UNDO_DELETE_TEXT, row->idx, at, &row->chars[at], dellen);
+    if (len > 0) editorJournal(UNDO_INSERT_TEXT, row->idx, at, s, len);
+    editorRowUnshare(row);
+    if (len > dellen) row->chars = editorRealloc(row->chars, row->size - dellen + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at + dellen], row->size - at - dellen + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len - dellen;
+    editorUpdateRow(row);
+}
+
+void editorRowDelChar(erow *row, int at) {
+    editorRowDelString(row, at, 1);
+}
+
+void editorInsertText(const char *s, int len) {
     if (E.cy == E.numrows) {
         editorInsertRow(E.numrows, "", 0);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    editorRowInsertString(&E.row[E.cy], E.cx, s, len);
+    E.cx += len;
+}
+
+void editorInsertChar(int c) {
+    char ch = c;
+    editorInsertText(&ch, 1);
 }
 
 void editorInsertNewLine() {
@@ -512,22 +1889,31 @@ void editorInsertNewLine() {
         erow *row = &E.row[E.cy];
         editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
         row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        editorRowDelString(row, E.cx, row->size - E.cx);
     }
     E.cy++;
     E.cx = 0;
 }
 
+int editorRowIsCombining(erow *row, int at) {
+    int cp;
+    if (((unsigned char)row->chars[at] & 0xC0) == 0x80) return 1;
+    if (utf8Decode(&row->chars[at], row->size - at, &cp) < 2) return 0;
+    return utf8CharWidth(cp) == 0;
+}
+
 void editorDelChar() {
     if (E.cy == E.numrows) return;
     if (E.cx == 0 && E.cy == 0) return;
 
     erow *row = &E.row[E.cy];
     if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        int at = E.cx;
+        do {
+            at = utf8PrevChar(row->chars, at);
+        } while (at > 0 && editorRowIsCombining(row, at));
+        editorRowDelString(row, at, E.cx - at);
+        E.cx = at;
     } else {
         E.cx = E.row[E.cy - 1].size;
         editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
@@ -536,6 +1922,494 @@ void editorDelChar() {
     }
 }
 
+void editorBlockRange(int *top, int *bottom, int *left, int *right) {
+    int rx = (E.cy < E.numrows) ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+    *top = E.block.row < E.cy ? E.block.row : E.cy;
+    *bottom = E.block.row > E.cy ? E.block.row : E.cy;
+    if (*bottom >= E.numrows) *bottom = E.numrows - 1;
+    *left = E.block.rx < rx ? E.block.rx : rx;
+    *right = E.block.rx > rx ? E.block.rx : rx;
+}
+
+/* The region between the mark and the cursor, in file order. Both ends
+ * are clamped to the text, as edits may have moved it under the mark. */
+void editorMarkRange(int *r1, int *c1, int *r2, int *c2) {
+    int mr = E.mark.row < E.numrows ? E.mark.row : E.numrows - 1;
+    int mc = E.mark.col < E.row[mr].size ? E.mark.col : E.row[mr].size;
+    int cr = E.cy, cc = E.cx;
+    if (cr >= E.numrows) {
+        cr = E.numrows - 1;
+        cc = E.row[cr].size;
+    }
+    if (mr < cr || (mr == cr && mc < cc)) {
+        *r1 = mr; *c1 = mc; *r2 = cr; *c2 = cc;
+    } else {
+        *r1 = cr; *c1 = cc; *r2 = mr; *c2 = mc;
+    }
+}
+
+/* Display columns selected in a row, as [lo, hi); empty when lo == hi.
+ * A block of width zero shows a one column cursor on each of its rows.
+ * Region rows before the last one run on past their end, newline and all. */
+void editorRowSelection(int filerow, int *lo, int *hi) {
+    *lo = *hi = 0;
+    if (E.block.active) {
+        int top, bottom, left, right;
+        editorBlockRange(&top, &bottom, &left, &right);
+        if (filerow < top || filerow > bottom) return;
+        *lo = left;
+        *hi = right > left ? right : left + 1;
+    } else if (E.mark.active && E.numrows > 0) {
+        int r1, c1, r2, c2;
+        editorMarkRange(&r1, &c1, &r2, &c2);
+        if (filerow < r1 || filerow > r2) return;
+        *lo = (filerow == r1) ? editorRowCxToRx(&E.row[filerow], c1) : 0;
+        *hi = (filerow == r2) ? editorRowCxToRx(&E.row[filerow], c2) : INT_MAX;
+    }
+}
+
+void editorBlockToggle() {
+    E.block.active = !E.block.active;
+    E.mark.active = 0;
+    if (E.block.active) {
+        E.block.row = E.cy;
+        E.block.rx = (E.cy < E.numrows) ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+        editorSetStatusMessage("Block: move to select, type to edit every row, Esc to end");
+    } else {
+        editorSetStatusMessage("");
+    }
+}
+
+/* Applies one edit to every row of the block in a single batch: the
+ * selected columns are replaced by s, or with a zero width block, dir
+ * deletes the character before (-1) or after (1) the column. Rows that
+ * end before the column are left alone. Afterwards the block collapses
+ * to a column just past the edit. */
+void editorBlockEdit(const char *s, int len, int dir) {
+    int top, bottom, left, right;
+    if (E.numrows == 0) return;
+    editorBlockRange(&top, &bottom, &left, &right);
+    int newcol = left;
+    for (int k = 0; k < len;) {
+        int cp, n = utf8Decode(&s[k], len - k, &cp);
+        if (s[k] == '\t') newcol += KILO_TAB_STOP - newcol % KILO_TAB_STOP;
+        else newcol += (n < 0) ? 1 : utf8CharWidth(cp);
+        k += (n < 1) ? 1 : n;
+    }
+    int cx = -1;
+
+    editorBatchBegin();
+    for (int r = top; r <= bottom; r++) {
+        erow *row = &E.row[r];
+        if (editorRowCxToRx(row, row->size) < left) continue;
+        int a = editorRowRxToCx(row, left);
+        int b = editorRowRxToCx(row, right);
+        if (b == a && dir < 0) {
+            if (a == 0) continue;
+            do {
+                a = utf8PrevChar(row->chars, a);
+            } while (a > 0 && editorRowIsCombining(row, a));
+        } else if (b == a && dir > 0) {
+            if (a == row->size) continue;
+            do {
+                b = utf8NextChar(row->chars, row->size, b);
+            } while (b < row->size && editorRowIsCombining(row, b));
+        }
+        editorRowSplice(row, a, b - a, s, len);
+        if (r == E.cy) cx = a + len;
+    }
+    E.dirty++;
+    editorBatchEnd();
+
+    if (cx >= 0) {
+        E.cx = cx;
+        newcol = editorRowCxToRx(&E.row[E.cy], cx);
+    } else {
+        if (dir < 0 && right == left && newcol > 0) newcol--;
+        if (E.cy < E.numrows) E.cx = editorRowRxToCx(&E.row[E.cy], newcol);
+    }
+    E.block.rx = newcol;
+}
+
+/* Reads the rest of the UTF-8 character that starts with key c into buf
+ * and returns its length, or 0 with a status message if it is malformed. */
+int editorReadUtf8(int c, char *buf) {
+    int cp;
+    int n = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+    buf[0] = c;
+    for (int k = 1; k < n; k++) buf[k] = editorReadKey();
+    if (utf8Decode(buf, n, &cp) == n) return n;
+    editorSetStatusMessage("Ignored invalid UTF-8 input");
+    return 0;
+}
+
+/* Keys that act on the whole block; returns 0 for keys that should get
+ * their normal meaning, such as movement that extends the block. */
+int editorBlockKey(int c) {
+    char ch = c;
+    switch (c) {
+        case '\x1b':
+        case CTRL_KEY('b'):
+        case '\r':
+            editorBlockToggle();
+            return 1;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            editorBlockEdit("", 0, -1);
+            return 1;
+        case DEL_KEY:
+            editorBlockEdit("", 0, 1);
+            return 1;
+    }
+    if ((c >= 32 && c < 127) || c == '\t') {
+        editorBlockEdit(&ch, 1, 0);
+        return 1;
+    }
+    if (c >= 0x80 && c < 0x100) {
+        char buf[4];
+        int n = editorReadUtf8(c, buf);
+        if (n) editorBlockEdit(buf, n, 0);
+        return 1;
+    }
+    return 0;
+}
+
+void editorUndoApply(struct undoOp *op, int undo) {
+    struct undoLog *u = &E.undo;
+    char *text = &u->arena[op->text];
+    char *tmp = NULL;
+    if (op->reversed) {
+        tmp = editorMalloc(op->len);
+        for (int j = 0; j < op->len; j++) tmp[j] = text[op->len - 1 - j];
+        text = tmp;
+    }
+
+    int type = op->type;
+    if (undo) type ^= 1;
+    switch (type) {
+        case UNDO_INSERT_TEXT:
+            editorRowInsertString(&E.row[op->row], op->col, text, op->len);
+            E.cx = op->col + op->len;
+            break;
+        case UNDO_DELETE_TEXT:
+            editorRowDelString(&E.row[op->row], op->col, op->len);
+            E.cx = op->col;
+            break;
+        case UNDO_INSERT_ROW:
+            editorInsertRow(op->row, text, op->len);
+            E.cx = 0;
+            break;
+        case UNDO_DELETE_ROW:
+            editorDelRow(op->row);
+            E.cx = 0;
+            break;
+        case UNDO_INSERT_ROWS:
+            editorInsertRows(op->row, op->rows);
+            E.cx = 0;
+            break;
+        case UNDO_DELETE_ROWS:
+            editorDelRows(op->row, op->col);
+            E.cx = 0;
+            break;
+    }
+    E.cy = op->row;
+    free(tmp);
+}
+
+/* Replays one whole group of ops as a single batch, so a bulk edit is
+ * undone with one highlight pass and one redraw. */
+void editorUndoGroup(int undo) {
+    struct undoLog *u = &E.undo;
+    if (undo ? u->nops == 0 : u->nops == u->top) {
+        editorSetStatusMessage(undo ? "Nothing to undo" : "Nothing to redo");
+        return;
+    }
+
+    int group = undo ? u->ops[u->nops - 1].group : u->ops[u->nops].group;
+    int count = 0;
+    int dirty = E.dirty;
+    u->suspended++;
+    editorBatchBegin();
+    if (undo) {
+        while (u->nops > 0 && u->ops[u->nops - 1].group == group) {
+            editorUndoApply(&u->ops[--u->nops], 1);
+            count++;
+        }
+    } else {
+        while (u->nops < u->top && u->ops[u->nops].group == group) {
+            editorUndoApply(&u->ops[u->nops++], 0);
+            count++;
+        }
+    }
+    editorBatchEnd();
+    u->suspended--;
+
+    E.dirty = (u->nops == u->clean) ? 0 : dirty + 1;
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    if (E.cy == E.numrows) E.cx = 0;
+    else if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    editorSetStatusMessage("%s %d change%s", undo ? "Undid" : "Redid", count,
+                           count == 1 ? "" : "s");
+}
+
+void editorMarkToggle() {
+    E.mark.active = !E.mark.active;
+    E.mark.row = E.cy;
+    E.mark.col = E.cx;
+    E.block.active = 0;
+    editorSetStatusMessage(E.mark.active ? "Mark set" : "Mark cleared");
+}
+
+void editorKillFree(struct killEntry *k) {
+    free(k->head);
+    free(k->tail);
+    editorSliceRelease(k->rows);
+    memset(k, 0, sizeof(*k));
+}
+
+/* Puts the region in a new kill ring entry and, with cut, deletes it.
+ * The full lines inside the region are shared with the entry rather than
+ * copied, and a cut hands them to the undo log with one move of the rows
+ * below, so large regions cost pointer work per row and no text copies. */
+void editorKillRegion(int cut) {
+    if (!E.mark.active || E.numrows == 0) {
+        editorSetStatusMessage("No region: Ctrl-Space sets the mark");
+        return;
+    }
+    int r1, c1, r2, c2;
+    editorMarkRange(&r1, &c1, &r2, &c2);
+    E.mark.active = 0;
+    if (r1 == r2 && c1 == c2) return;
+
+    struct editorKill *kr = &E.kill;
+    kr->newest = (kr->newest + 1) % KILO_KILL_RING;
+    if (kr->count < KILO_KILL_RING) kr->count++;
+    struct killEntry *k = &kr->ring[kr->newest];
+    editorKillFree(k);
+
+    erow *first = &E.row[r1];
+    erow *last = &E.row[r2];
+    k->headlen = ((r1 == r2) ? c2 : first->size) - c1;
+    k->head = editorMalloc(k->headlen + 1);
+    memcpy(k->head, &first->chars[c1], k->headlen);
+    if (r1 < r2) {
+        k->taillen = c2;
+        k->tail = editorMalloc(c2 + 1);
+        memcpy(k->tail, last->chars, c2);
+        if (r2 - r1 > 1) k->rows = editorSliceCopy(r1 + 1, r2 - r1 - 1);
+    }
+
+    if (cut) {
+        E.undo.group++;
+        editorBatchBegin();
+        if (r1 == r2) {
+            editorRowSplice(first, c1, c2 - c1, "", 0);
+        } else {
+            editorRowSplice(first, c1, first->size - c1, &last->chars[c2], last->size - c2);
+            editorDelRows(r1 + 1, r2 - r1);
+        }
+        E.dirty++;
+        editorBatchEnd();
+        E.cy = r1;
+        E.cx = c1;
+    }
+    editorSetStatusMessage("%s %d line%s", cut ? "Cut" : "Copied", r2 - r1 + 1,
+                           r2 > r1 ? "s" : "");
+}
+
+/* Inserts kill ring entry i at the cursor as one batch and one undo step
+ * of its own: the shared lines go in with editorInsertRows and only the
+ * split row is rewritten. */
+void editorKillYank(int i) {
+    struct editorKill *kr = &E.kill;
+    struct killEntry *k = &kr->ring[i];
+    E.undo.group++;
+    kr->yank = i;
+    kr->yank_group = E.undo.group;
+    kr->yank_row = E.cy;
+    kr->yank_col = E.cx;
+    E.mark.active = 0;
+
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+    editorBatchBegin();
+    erow *row = &E.row[E.cy];
+    if (k->tail == NULL) {
+        editorRowSplice(row, E.cx, 0, k->head, k->headlen);
+        E.cx += k->headlen;
+    } else {
+        int n = k->rows ? k->rows->nrows : 0;
+        int rest = row->size - E.cx;
+        char *line = editorMalloc(k->taillen + rest + 1);
+        memcpy(line, k->tail, k->taillen);
+        memcpy(&line[k->taillen], &row->chars[E.cx], rest);
+        editorRowSplice(row, E.cx, rest, k->head, k->headlen);
+        if (n) editorInsertRows(E.cy + 1, k->rows);
+        editorInsertRow(E.cy + 1 + n, line, k->taillen + rest);
+        free(line);
+        E.cy += 1 + n;
+        E.cx = k->taillen;
+    }
+    E.dirty++;
+    editorBatchEnd();
+}
+
+/* Pastes the newest entry; with pop, right after a paste, swaps the
+ * pasted text for the next older entry, as undo then paste. */
+void editorKillPaste(int pop) {
+    struct editorKill *kr = &E.kill;
+    if (kr->count == 0) {
+        editorSetStatusMessage("Kill ring is empty");
+        return;
+    }
+    if (!pop) {
+        editorKillYank(kr->newest);
+        return;
+    }
+    if (kr->yank_group != E.undo.group - 1) {
+        editorSetStatusMessage("Ctrl-K only follows a paste");
+        return;
+    }
+    editorUndoGroup(1);
+    E.cy = kr->yank_row;
+    E.cx = kr->yank_col;
+    int age = (kr->newest - kr->yank + KILO_KILL_RING) % KILO_KILL_RING;
+    age = (age + 1) % kr->count;
+    editorKillYank((kr->newest - age + KILO_KILL_RING) % KILO_KILL_RING);
+    editorSetStatusMessage("Pasted kill %d of %d", age + 1, kr->count);
+}
+
+char *editorSwapPath(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    base = base ? base + 1 : filename;
+
+    char *path = editorMalloc(dirlen + strlen(base) + 6);
+    sprintf(path, "%.*s.%s.swp", dirlen, filename, base);
+    return path;
+}
+
+void editorSwapWriteHeader() {
+    struct swapHeader h;
+    struct stat st;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "KILOSWP1", 8);
+    if (stat(E.filename, &st) == 0) {
+        h.size = st.st_size;
+        h.mtime = st.st_mtime;
+    } else {
+        h.size = -1;
+    }
+    if (ftruncate(E.swap.fd, 0) == -1 ||
+        write(E.swap.fd, &h, sizeof(h)) != sizeof(h)) {
+        close(E.swap.fd);
+        E.swap.fd = -1;
+    }
+}
+
+void editorSwapFlush(int force) {
+    struct editorSwap *sw = &E.swap;
+    if (sw->len == 0) return;
+    long long now = editorNow();
+    if (!force && now - sw->last_flush < sw->interval * 1000000LL) return;
+
+    if (sw->fd == -1) {
+        sw->fd = open(sw->path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (sw->fd != -1) editorSwapWriteHeader();
+    }
+    if (sw->fd == -1 || write(sw->fd, sw->pending, sw->len) != (ssize_t)sw->len)
+        editorSetStatusMessage("Cant write swap file %s: %s", sw->path, strerror(errno));
+    sw->len = 0;
+    sw->last_flush = now;
+}
+
+void editorSwapClose(int unlink_file) {
+    struct editorSwap *sw = &E.swap;
+    if (sw->fd != -1) close(sw->fd);
+    if (unlink_file && sw->path) unlink(sw->path);
+    free(sw->path);
+    sw->path = NULL;
+    sw->fd = -1;
+    sw->len = 0;
+}
+
+void editorSwapOpen() {
+    editorSwapClose(0);
+    if (E.headless || E.follow.enabled || E.swap.interval <= 0 || E.filename == NULL) return;
+    E.swap.path = editorSwapPath(E.filename);
+    E.swap.last_flush = editorNow();
+}
+
+int editorSwapReplay(char *buf, size_t len) {
+    size_t off = sizeof(struct swapHeader);
+    size_t head = 1 + 3 * sizeof(int);
+    int count = 0;
+
+    editorBatchBegin();
+    while (off + head <= len) {
+        int type = buf[off];
+        int row, col, n;
+        memcpy(&row, &buf[off + 1], sizeof(int));
+        memcpy(&col, &buf[off + 1 + sizeof(int)], sizeof(int));
+        memcpy(&n, &buf[off + 1 + 2 * sizeof(int)], sizeof(int));
+        char *text = &buf[off + head];
+        if (n < 0 || off + head + n > len) break;
+
+        int rowop = (type == UNDO_INSERT_ROW || type == UNDO_DELETE_ROW);
+        if (row < 0 || row > E.numrows || (row == E.numrows && type != UNDO_INSERT_ROW)) break;
+        if (!rowop && (col < 0 || col > E.row[row].size)) break;
+
+        switch (type) {
+            case UNDO_INSERT_TEXT: editorRowInsertString(&E.row[row], col, text, n); break;
+            case UNDO_DELETE_TEXT: editorRowDelString(&E.row[row], col, n); break;
+            case UNDO_INSERT_ROW: editorInsertRow(row, text, n); break;
+            case UNDO_DELETE_ROW: editorDelRow(row); break;
+        }
+        off += head + n;
+        count++;
+    }
+    editorBatchEnd();
+    return count;
+}
+
+void editorSwapRecover() {
+    struct editorSwap *sw = &E.swap;
+    if (sw->path == NULL) return;
+
+    int fd = open(sw->path, O_RDONLY);
+    if (fd == -1) return;
+
+    struct stat st, fst;
+    struct swapHeader h;
+    if (fstat(fd, &st) == -1 || st.st_size <= (off_t)sizeof(h) ||
+        read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, "KILOSWP1", 8)) {
+        close(fd);
+        return;
+    }
+    if (stat(E.filename, &fst) == -1 || fst.st_size != h.size || fst.st_mtime != h.mtime) {
+        close(fd);
+        editorSetStatusMessage("Ignoring swap file %s: file changed on disk", sw->path);
+        return;
+    }
+
+    char *buf = editorMalloc(st.st_size);
+    ssize_t n = pread(fd, buf, st.st_size, 0);
+    close(fd);
+
+    char *answer = editorPrompt("Found unsaved changes in swap file. Recover them? (y/n) %s", NULL);
+    if (answer && (answer[0] == 'y' || answer[0] == 'Y') && n > 0) {
+        sw->suspended++;
+        int count = editorSwapReplay(buf, n);
+        sw->suspended--;
+        sw->fd = open(sw->path, O_WRONLY | O_APPEND);
+        E.dirty = 1;
+        editorSetStatusMessage("Recovered %d changes from %s", count, sw->path);
+    } else {
+        unlink(sw->path);
+    }
+    free(answer);
+    free(buf);
+}
+
 char *editorRowsToString(int *buflen) {
     int totlen = 0;
     int j;
@@ -544,7 +2418,7 @@ char *editorRowsToString(int *buflen) {
     }
     *buflen = totlen;
 
-    char *buf = malloc(totlen);
+    char *buf = editorMalloc(totlen);
     char *p = buf;
     for (j = 0; j < E.numrows; j++) {
         memcpy(p, E.row[j].chars, E.row[j].size);
@@ -560,16 +2434,19 @@ void editorOpen(char *filename) {
     free(E.filename);
     E.filename = strdup(filename);
 
-    editorSelectSyntaxHighlight();
-
     FILE *fp = fopen(filename, "r");
     if (!fp) die("fopen");
+    E.undo.suspended++;
 
     char *line = NULL;
     size_t linecap = 0;
     ssize_t linelen;
 
+    E.follow.offset = 0;
+    E.follow.partial = 0;
     while((linelen = getline(&line, &linecap, fp)) != -1) {
+        E.follow.offset += linelen;
+        E.follow.partial = (line[linelen - 1] != '\n');
         while (linelen > 0 && (line[linelen - 1] == '\n' ||
                                line[linelen - 1] == '\r'))
             linelen--;
@@ -577,7 +2454,420 @@ void editorOpen(char *filename) {
     }
     free(line);
     fclose(fp);
+    E.undo.suspended--;
+    editorUndoReset();
+    editorSelectSyntaxHighlight();
     E.dirty = 0;
+    editorSwapOpen();
+    editorSwapRecover();
+}
+
+void editorBufferStore(struct editorBuffer *b) {
+    b->cx = E.cx;
+    b->cy = E.cy;
+    b->rx = E.rx;
+    b->rowoff = E.rowoff;
+    b->coloff = E.coloff;
+    b->numrows = E.numrows;
+    b->rowcap = E.rowcap;
+    b->row = E.row;
+    b->dirty = E.dirty;
+    b->filename = E.filename;
+    b->syntax = E.syntax;
+    b->hl_next = E.hl_next;
+    b->undo = E.undo;
+    b->swap = E.swap;
+    b->bytes = E.bytes;
+    b->wrapoff = E.wrapoff;
+    b->wrapcols = E.wrapcols;
+    b->vlines = E.vlines;
+}
+
+void editorBufferLoad(struct editorBuffer *b) {
+    E.cx = b->cx;
+    E.cy = b->cy;
+    E.rx = b->rx;
+    E.rowoff = b->rowoff;
+    E.coloff = b->coloff;
+    E.numrows = b->numrows;
+    E.rowcap = b->rowcap;
+    E.row = b->row;
+    E.dirty = b->dirty;
+    E.filename = b->filename;
+    E.syntax = b->syntax;
+    E.hl_next = b->hl_next;
+    E.undo = b->undo;
+    E.swap = b->swap;
+    E.bytes = b->bytes;
+    E.wrapoff = b->wrapoff;
+    E.wrapcols = b->wrapcols;
+    E.vlines = b->vlines;
+}
+
+size_t editorBufferCacheSize(struct editorBuffer *b) {
+    size_t size = 0;
+    for (int j = 0; j < b->numrows; j++) {
+        erow *row = &b->row[j];
+        if (row->render) size += row->rsize + 1;
+        if (row->hl) size += row->rsize;
+        if (row->cw) size += row->rsize;
+    }
+    return size;
+}
+
+/* Drops the render, width and highlight data of an inactive buffer. Only
+ * chars is kept; editorBufferSwitch renders the rows again and the
+ * highlight thread picks them up as pending. Rows shared with the kill
+ * ring or the undo log keep their render, which is shared too. */
+void editorBufferEvict(struct editorBuffer *b) {
+    for (int j = 0; j < b->numrows; j++) {
+        erow *row = &b->row[j];
+        free(row->hl);
+        row->hl = NULL;
+        row->hl_state = ROW_HL_PENDING;
+        if (row->refs) continue;
+        free(row->render);
+        free(row->cw);
+        row->render = NULL;
+        row->cw = NULL;
+        row->rsize = 0;
+    }
+    b->hl_next = 0;
+    b->cache = 0;
+    b->evicted = 1;
+}
+
+void editorBufferEnforceBudget() {
+    size_t total = E.buffers[E.current].cache;
+    for (int i = 0; i < E.nbuffers; i++)
+        if (i != E.current) total += E.buffers[i].cache;
+    while (total > E.cache_budget) {
+        int lru = -1;
+        for (int i = 0; i < E.nbuffers; i++) {
+            struct editorBuffer *b = &E.buffers[i];
+            if (i == E.current || b->cache == 0) continue;
+            if (lru == -1 || b->last_used < E.buffers[lru].last_used) lru = i;
+        }
+        if (lru == -1) break;
+        total -= E.buffers[lru].cache;
+        editorBufferEvict(&E.buffers[lru]);
+    }
+}
+
+void editorBufferSwitch(int i) {
+    if (i == E.current || i < 0 || i >= E.nbuffers) return;
+    editorSwapFlush(1);
+    struct editorBuffer *cur = &E.buffers[E.current];
+    editorBufferStore(cur);
+    cur->last_used = editorNow();
+    cur->cache = editorBufferCacheSize(cur);
+
+    E.current = i;
+    E.block.active = 0;
+    E.mark.active = 0;
+    E.kill.yank_group = -1;
+    struct editorBuffer *b = &E.buffers[i];
+    editorBufferLoad(b);
+    if (b->evicted) {
+        for (int j = 0; j < E.numrows; j++)
+            if (E.row[j].render == NULL) editorRenderRow(&E.row[j]);
+        b->evicted = 0;
+    }
+    b->cache = editorBufferCacheSize(b);
+    editorBufferEnforceBudget();
+    pthread_cond_signal(&E.hl_cond);
+}
+
+int editorBufferNew() {
+    E.buffers = editorRealloc(E.buffers, sizeof(struct editorBuffer) * (E.nbuffers + 1));
+    struct editorBuffer *b = &E.buffers[E.nbuffers];
+    memset(b, 0, sizeof(*b));
+    b->swap.fd = -1;
+    b->swap.interval = E.swap.interval;
+    b->bytes.metric = editorRowBytes;
+    b->vlines.metric = editorRowVisualLines;
+    return E.nbuffers++;
+}
+
+/* Switches to the buffer holding filename, opening it in a new buffer
+ * if there is none. A missing file gives an empty buffer to save into. */
+void editorBufferOpen(char *filename) {
+    for (int i = 0; i < E.nbuffers; i++) {
+        char *name = (i == E.current) ? E.filename : E.buffers[i].filename;
+        if (name && strcmp(name, filename) == 0) {
+            editorBufferSwitch(i);
+            return;
+        }
+    }
+    editorBufferSwitch(editorBufferNew());
+    if (access(filename, F_OK) == 0) {
+        editorOpen(filename);
+    } else {
+        E.filename = strdup(filename);
+        editorSelectSyntaxHighlight();
+        editorSwapOpen();
+    }
+}
+
+void editorBufferPrompt() {
+    if (E.follow.enabled) {
+        editorSetStatusMessage("Can't switch files in follow mode");
+        return;
+    }
+    char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+    if (filename == NULL) return;
+    if (filename[0]) editorBufferOpen(filename);
+    free(filename);
+}
+
+/* Closes the swap journals of the inactive buffers before exit. */
+void editorBufferCloseAll() {
+    for (int i = 0; i < E.nbuffers; i++) {
+        struct editorSwap *sw = &E.buffers[i].swap;
+        if (i == E.current) continue;
+        if (sw->fd != -1) close(sw->fd);
+        if (sw->path) unlink(sw->path);
+    }
+    editorSwapClose(1);
+}
+
+int editorBuffersDirty() {
+    int dirty = E.dirty ? 1 : 0;
+    for (int i = 0; i < E.nbuffers; i++)
+        if (i != E.current && E.buffers[i].dirty) dirty++;
+    return dirty;
+}
+
+void editorFollowStart() {
+    struct editorFollow *f = &E.follow;
+    f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    f->fd = open(E.filename, O_RDONLY);
+    if (f->ifd == -1 || f->fd == -1 || inotify_add_watch(f->ifd, E.filename, IN_MODIFY) == -1) {
+        editorSetStatusMessage("Cant follow %s: %s", E.filename, strerror(errno));
+        f->enabled = 0;
+        return;
+    }
+    f->behind = 1;
+}
+
+/* Appends bytes read from the end of a followed file: a partial last line
+ * is extended in place and the new rows go in as one batch. They come
+ * from disk, so they stay out of the undo log and the dirty count. */
+void editorFollowAppend(char *buf, size_t len) {
+    struct editorFollow *f = &E.follow;
+    int at_end = (E.cy >= E.numrows - 1);
+    int dirty = E.dirty;
+
+    E.undo.suspended++;
+    editorBatchBegin();
+    size_t start = 0;
+    while (start < len) {
+        char *nl = memchr(&buf[start], '\n', len - start);
+        size_t end = nl ? (size_t)(nl - buf) : len;
+        size_t linelen = end - start;
+        if (nl && linelen > 0 && buf[end - 1] == '\r') linelen--;
+
+        if (f->partial && E.numrows > 0) editorRowAppendString(&E.row[E.numrows - 1], &buf[start], linelen);
+        else editorInsertRow(E.numrows, &buf[start], linelen);
+        f->partial = (nl == NULL);
+        start = end + 1;
+    }
+    editorBatchEnd();
+    E.undo.suspended--;
+    E.dirty = dirty;
+
+    if (at_end && E.numrows > 0) {
+        E.cy = E.numrows - 1;
+        if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    }
+    E.redraw = 1;
+}
+
+void editorFollowPoll() {
+    struct editorFollow *f = &E.follow;
+    if (!f->enabled) return;
+
+    char events[4096];
+    int changed = f->behind;
+    while (read(f->ifd, events, sizeof(events)) > 0) changed = 1;
+    if (!changed) return;
+
+    struct stat st;
+    if (fstat(f->fd, &st) == -1) return;
+    if (st.st_size < f->offset) {
+        editorSetStatusMessage("%s was truncated", E.filename);
+        f->offset = st.st_size;
+        f->behind = 0;
+        E.redraw = 1;
+        return;
+    }
+
+    off_t want = st.st_size - f->offset;
+    f->behind = (want > KILO_FOLLOW_CHUNK);
+    if (want > KILO_FOLLOW_CHUNK) want = KILO_FOLLOW_CHUNK;
+    if (want == 0) return;
+
+    char *buf = editorMalloc(want);
+    ssize_t n = pread(f->fd, buf, want, f->offset);
+    if (n > 0) {
+        editorFollowAppend(buf, n);
+        f->offset += n;
+    }
+    free(buf);
+}
+
+/* Substring search. With SSE2, 16 candidate positions are tested at a
+ * time by matching the needle's first and last bytes, and only the hits
+ * are compared in full. */
+char *editorMemFind(const char *hay, size_t n, const char *needle, size_t m) {
+    if (m == 0) return (char *)hay;
+    if (n < m) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return (char *)hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    hay += i;
+    n -= i;
+#endif
+    const char *end = hay + n;
+    while ((size_t)(end - hay) >= m) {
+        const char *p = memchr(hay, needle[0], end - hay - m + 1);
+        if (p == NULL) return NULL;
+        if (memcmp(p, needle, m) == 0) return (char *)p;
+        hay = p + 1;
+    }
+    return NULL;
+}
+
+void editorPagerPublish(long long *found, int n, long long lines, size_t indexed) {
+    struct editorPager *p = &E.pager;
+    pthread_mutex_lock(&E.lock);
+    if (p->nindex + n > p->capindex) {
+        while (p->nindex + n > p->capindex) p->capindex = p->capindex ? p->capindex * 2 : 256;
+        p->index = editorRealloc(p->index, sizeof(long long) * p->capindex);
+    }
+    memcpy(&p->index[p->nindex], found, sizeof(long long) * n);
+    p->nindex += n;
+    p->lines = lines;
+    p->indexed = indexed;
+    if (indexed == p->size) p->done = 1;
+    E.redraw = 1;
+    pthread_mutex_unlock(&E.lock);
+}
+
+void *editorPagerIndexThread(void *arg) {
+    (void)arg;
+    struct editorPager *p = &E.pager;
+    int cap = KILO_PAGER_SLICE / KILO_PAGER_STRIDE + 1;
+    long long *found = editorMalloc(sizeof(long long) * cap);
+    long long lines = 0;
+    size_t off = 0;
+    while (off < p->size) {
+        size_t end = off + KILO_PAGER_SLICE;
+        if (end > p->size) end = p->size;
+        int n = 0;
+        while (off < end) {
+            char *nl = memchr(&p->map[off], '\n', end - off);
+            if (nl == NULL) {
+                off = end;
+                break;
+            }
+            off = nl - p->map + 1;
+            if (++lines % KILO_PAGER_STRIDE == 0 && off < p->size) found[n++] = off;
+        }
+        if (off == p->size && p->map[off - 1] != '\n') lines++;
+        editorPagerPublish(found, n, lines, off);
+    }
+    free(found);
+    return NULL;
+}
+
+int editorPagerOpen(char *filename) {
+    struct editorPager *p = &E.pager;
+    struct stat st;
+    free(E.filename);
+    E.filename = strdup(filename);
+    p->fd = open(filename, O_RDONLY);
+    if (p->fd == -1 || fstat(p->fd, &st) == -1) return -1;
+    p->size = st.st_size;
+    p->index = editorMalloc(sizeof(long long) * 256);
+    p->capindex = 256;
+    p->index[0] = 0;
+    p->nindex = 1;
+    if (p->size == 0) {
+        p->done = 1;
+        return 0;
+    }
+    p->map = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, p->fd, 0);
+    if (p->map == MAP_FAILED) return -1;
+    madvise(p->map, p->size, MADV_SEQUENTIAL);
+    if (pthread_create(&p->thread, NULL, editorPagerIndexThread, NULL) != 0) die("pthread_create");
+    pthread_detach(p->thread);
+    return 0;
+}
+
+size_t editorPagerLineBegin(size_t off) {
+    while (off > 0 && E.pager.map[off - 1] != '\n') off--;
+    return off;
+}
+
+size_t editorPagerNextLine(size_t off) {
+    struct editorPager *p = &E.pager;
+    char *nl = memchr(&p->map[off], '\n', p->size - off);
+    return nl ? (size_t)(nl - p->map) + 1 : p->size;
+}
+
+size_t editorPagerPrevLine(size_t off) {
+    return off == 0 ? 0 : editorPagerLineBegin(off - 1);
+}
+
+/* Line number of the line starting at off, or -1 if the index does not
+ * reach that far yet. At most one stride of lines is scanned. */
+long long editorPagerLineOf(size_t off) {
+    struct editorPager *p = &E.pager;
+    if (off > p->indexed && !p->done) return -1;
+    int lo = 0, hi = p->nindex - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if ((size_t)p->index[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    long long line = (long long)lo * KILO_PAGER_STRIDE;
+    size_t pos = p->index[lo];
+    while (pos < off) {
+        char *nl = memchr(&p->map[pos], '\n', off - pos);
+        if (nl == NULL) break;
+        pos = nl - p->map + 1;
+        line++;
+    }
+    return line;
+}
+
+/* Byte offset of the start of a line, or -1 if it is past the index. */
+long long editorPagerLineStart(long long line) {
+    struct editorPager *p = &E.pager;
+    long long k = line / KILO_PAGER_STRIDE;
+    if (k >= p->nindex) return -1;
+    size_t pos = p->index[k];
+    size_t limit = p->done ? p->size : p->indexed;
+    for (long long j = k * KILO_PAGER_STRIDE; j < line; j++) {
+        char *nl = memchr(&p->map[pos], '\n', limit - pos);
+        if (nl == NULL || (size_t)(nl - p->map) + 1 >= p->size) return -1;
+        pos = nl - p->map + 1;
+    }
+    return pos;
 }
 
 void editorSave() {
@@ -588,8 +2878,10 @@ void editorSave() {
             return;
         }
         editorSelectSyntaxHighlight();
+        editorSwapOpen();
     }
 
+    long long start = editorStatsBegin();
     int len;
     char *buf = editorRowsToString(&len);
 
@@ -599,7 +2891,13 @@ void editorSave() {
             if (write(fd, buf, len) == len) {
                 close(fd);
                 free(buf);
+                editorStatsEnd(STAT_SAVE, start);
                 E.dirty = 0;
+                E.undo.clean = E.undo.nops;
+                E.swap.len = 0;
+                if (E.swap.fd != -1) editorSwapWriteHeader();
+                E.follow.offset = len;
+                E.follow.partial = 0;
                 editorSetStatusMessage("%d bytes written to disk", len);
                 return;
             }
@@ -639,6 +2937,8 @@ void editorFindCallback(char *query, int key) {
 
     if (last_match == -1) direction = 1;
     int current = last_match;
+    size_t qlen = strlen(query);
+    long long start = editorStatsBegin();
 
     int i;
     for (i = 0; i < E.numrows; i++) {
@@ -647,39 +2947,408 @@ void editorFindCallback(char *query, int key) {
         else if (current == E.numrows) current = 0;
 
         erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
+        char *match = editorMemFind(row->render, row->rsize, query, qlen);
         if (match) {
+            if (row->hl_state == ROW_HL_PENDING) editorHighlightGuess(row);
             last_match = current;
             E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
+            E.cx = editorRowRxToCx(row, editorRenderToRx(row, match - row->render));
             E.rowoff = E.numrows;
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+            saved_hl_line = current;
+            saved_hl = editorMalloc(row->rsize);
+            memcpy(saved_hl, row->hl, row->rsize);
+            memset(&row->hl[match - row->render], HL_MATCH, qlen);
+            break;
+        }
+    }
+    editorStatsEnd(STAT_FIND, start);
+}
+
+void editorFind() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    char *query = editorPrompt("Search : %s (use ESC/Arrows/Enter)",
+                               editorFindCallback);
+
+    if (query) {
+        free(query);
+    } else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+    }
+}
+
+/* Rewrites every match in a row into one new chars buffer. Only the
+ * matches are journaled, each as a delete and an insert at its column in
+ * the new row. Returns the number of matches. */
+int editorRowReplace(erow *row, const char *query, size_t qlen, const char *with, size_t wlen) {
+    char *match = editorMemFind(row->chars, row->size, query, qlen);
+    if (match == NULL) return 0;
+
+    size_t cap = row->size + 1 + (wlen > qlen ? (wlen - qlen) * 4 : 0);
+    char *buf = editorMalloc(cap);
+    size_t len = 0;
+    int count = 0;
+    char *p = row->chars;
+    char *end = row->chars + row->size;
+    while (match) {
+        size_t keep = match - p;
+        if (len + keep + wlen + 1 > cap) {
+            while (len + keep + wlen + 1 > cap) cap *= 2;
+            buf = editorRealloc(buf, cap);
+        }
+        memcpy(&buf[len], p, keep);
+        memcpy(&buf[len + keep], with, wlen);
+        editorJournal(UNDO_DELETE_TEXT, row->idx, len + keep, match, qlen);
+        if (wlen > 0) editorJournal(UNDO_INSERT_TEXT, row->idx, len + keep, with, wlen);
+        len += keep + wlen;
+        count++;
+        p = match + qlen;
+        match = editorMemFind(p, end - p, query, qlen);
+    }
+    if (len + (end - p) + 1 > cap) buf = editorRealloc(buf, len + (end - p) + 1);
+    memcpy(&buf[len], p, end - p);
+    len += end - p;
+    buf[len] = '\0';
+
+    editorRowRelease(row);
+    row->chars = buf;
+    row->size = len;
+    editorUpdateRow(row);
+    E.dirty++;
+    return count;
+}
+
+void editorReplace() {
+    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+    char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (with == NULL) {
+        free(query);
+        return;
+    }
+    size_t qlen = strlen(query);
+    size_t wlen = strlen(with);
+    if (qlen == 0 || E.numrows == 0) {
+        free(query);
+        free(with);
+        return;
+    }
+
+    int all = 0;
+    E.undo.group++;
+    editorSetStatusMessage("Replace all (a) or next (n)?");
+    editorRefreshScreen();
+    int c = editorReadKey();
+    if (c == 'a' || c == 'A') all = 1;
+    else if (c != 'n' && c != 'N') c = 0;
+
+    if (c && all) {
+        long long start = editorNow();
+        int count = 0, rows = 0;
+        editorBatchBegin();
+        for (int j = 0; j < E.numrows; j++) {
+            int n = editorRowReplace(&E.row[j], query, qlen, with, wlen);
+            if (n) rows++;
+            count += n;
+        }
+        editorBatchEnd();
+        editorSetStatusMessage("Replaced %d matches in %d lines (%.1f ms)", count, rows,
+                               (editorNow() - start) / 1e6);
+    } else if (c) {
+        for (int i = 0; i <= E.numrows && c; i++) {
+            int y = (E.cy + i) % E.numrows;
+            erow *row = &E.row[y];
+            int from = (i == 0 && E.cy < E.numrows) ? E.cx : 0;
+            int to = row->size;
+            if (i == E.numrows && E.cx + (int)qlen - 1 < to) to = E.cx + qlen - 1;
+            if (from > to) continue;
+            char *match = editorMemFind(&row->chars[from], to - from, query, qlen);
+            if (match == NULL) continue;
+            int at = match - row->chars;
+            editorBatchBegin();
+            editorRowDelString(row, at, qlen);
+            editorRowInsertString(row, at, with, wlen);
+            editorBatchEnd();
+            E.cy = y;
+            E.cx = at + wlen;
+            editorSetStatusMessage("Replaced 1 match");
+            c = 0;
+        }
+        if (c) editorSetStatusMessage("Not found: %s", query);
+    } else {
+        editorSetStatusMessage("");
+    }
+    free(query);
+    free(with);
+}
+
+void editorGoto() {
+    char *input = editorPrompt("Go to line, or b<offset> for a byte: %s (ESC to cancel)", NULL);
+    if (input == NULL) return;
+    if (E.numrows > 0) {
+        if (input[0] == 'b') {
+            long long rest;
+            E.cy = rowIndexFind(&E.bytes, atoll(&input[1]), &rest);
+            erow *row = &E.row[E.cy];
+            if (rest > row->size) rest = row->size;
+            while (rest > 0 && ((unsigned char)row->chars[rest] & 0xC0) == 0x80) rest--;
+            E.cx = rest;
+        } else {
+            long long line = atoll(input) - 1;
+            if (line < 0) line = 0;
+            if (line >= E.numrows) line = E.numrows - 1;
+            E.cy = line;
+            E.cx = 0;
+        }
+        E.rowoff = E.cy - E.screenrows / 2;
+        if (E.rowoff < 0) E.rowoff = 0;
+    }
+    free(input);
+}
+
+/* Project search: directories and files are tasks on per-worker queues.
+ * A worker pops its own newest task and steals the oldest from another
+ * queue when it runs dry; directories push their entries as new tasks. */
+void grepPush(struct grepQueue *q, char *path) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->items, &q->items[q->head], sizeof(char *) * (q->tail - q->head));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->cap) {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->items = editorRealloc(q->items, sizeof(char *) * q->cap);
+        }
+    }
+    q->items[q->tail++] = path;
+    __atomic_add_fetch(&E.grep.pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+}
+
+char *grepTake(struct grepQueue *q, int steal) {
+    char *path = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) path = steal ? q->items[q->head++] : q->items[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+void grepAddResult(const char *path, int line, int col, const char *text, size_t len) {
+    struct editorGrep *g = &E.grep;
+    if (len > 256) len = 256;
+    pthread_mutex_lock(&g->lock);
+    if (g->nresults == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 256;
+        g->results = editorRealloc(g->results, sizeof(struct grepResult) * g->cap);
+    }
+    struct grepResult *r = &g->results[g->nresults++];
+    r->path = strdup(path);
+    r->line = line;
+    r->col = col;
+    r->text = editorMalloc(len + 1);
+    memcpy(r->text, text, len);
+    r->text[len] = '\0';
+    pthread_mutex_unlock(&g->lock);
+}
+
+void grepFile(const char *path) {
+    struct editorGrep *g = &E.grep;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    size_t size = st.st_size;
+    if (memchr(map, '\0', size < 4096 ? size : 4096) == NULL) {
+        size_t pos = 0, counted = 0;
+        int line = 1;
+        char *match;
+        while (!__atomic_load_n(&g->cancel, __ATOMIC_RELAXED) &&
+               (match = editorMemFind(&map[pos], size - pos, g->query, g->qlen))) {
+            size_t at = match - map;
+            char *nl;
+            while ((nl = memchr(&map[counted], '\n', at - counted))) {
+                counted = nl - map + 1;
+                line++;
+            }
+            char *end = memchr(match, '\n', size - at);
+            size_t eol = end ? (size_t)(end - map) : size;
+            size_t len = eol - counted;
+            if (len > 0 && map[counted + len - 1] == '\r') len--;
+            grepAddResult(path, line, at - counted, &map[counted], len);
+            pos = counted = eol < size ? eol + 1 : size;
+            line++;
+        }
+    }
+    munmap(map, size);
+    __atomic_add_fetch(&g->files, 1, __ATOMIC_RELAXED);
+}
+
+void grepDir(struct grepQueue *q, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+    struct dirent *de;
+    while (!__atomic_load_n(&E.grep.cancel, __ATOMIC_RELAXED) && (de = readdir(dir))) {
+        if (de->d_name[0] == '.') continue;
+        size_t len = strlen(path) + strlen(de->d_name) + 2;
+        char *child = editorMalloc(len + 1);
+        int isdir = (de->d_type == DT_DIR);
+        snprintf(child + 1, len, "%s/%s", path, de->d_name);
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(child + 1, &st) == -1) {
+                free(child);
+                continue;
+            }
+            isdir = S_ISDIR(st.st_mode);
+            if (!isdir && !S_ISREG(st.st_mode)) {
+                free(child);
+                continue;
+            }
+        } else if (!isdir && de->d_type != DT_REG) {
+            free(child);
+            continue;
+        }
+        child[0] = isdir ? 'd' : 'f';
+        grepPush(q, child);
+    }
+    closedir(dir);
+}
+
+void *grepWorker(void *arg) {
+    struct editorGrep *g = &E.grep;
+    struct grepQueue *q = arg;
+    int self = q - g->queues;
+    while (__atomic_load_n(&g->pending, __ATOMIC_SEQ_CST) > 0) {
+        char *task = grepTake(q, 0);
+        for (int k = 1; task == NULL && k < g->nthreads; k++)
+            task = grepTake(&g->queues[(self + k) % g->nthreads], 1);
+        if (task == NULL) {
+            usleep(1000);
+            continue;
         }
+        if (!__atomic_load_n(&g->cancel, __ATOMIC_RELAXED)) {
+            if (task[0] == 'd') grepDir(q, task + 1);
+            else grepFile(task + 1);
+        }
+        free(task);
+        __atomic_sub_fetch(&g->pending, 1, __ATOMIC_SEQ_CST);
     }
+    return NULL;
 }
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+void editorGrepStop() {
+    struct editorGrep *g = &E.grep;
+    if (!g->running) return;
+    __atomic_store_n(&g->cancel, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < g->nthreads; i++) pthread_join(g->threads[i], NULL);
+    for (int i = 0; i < g->nthreads; i++) {
+        struct grepQueue *q = &g->queues[i];
+        while (q->head < q->tail) free(q->items[q->head++]);
+        free(q->items);
+        pthread_mutex_destroy(&q->lock);
+    }
+    g->running = 0;
+}
 
-    char *query = editorPrompt("Search : %s (use ESC/Arrows/Enter)",
-                               editorFindCallback);
+void editorGrepClear() {
+    struct editorGrep *g = &E.grep;
+    editorGrepStop();
+    for (int i = 0; i < g->nresults; i++) {
+        free(g->results[i].path);
+        free(g->results[i].text);
+    }
+    g->nresults = 0;
+    g->shown = 0;
+    g->sel = 0;
+    g->top = 0;
+    g->files = 0;
+}
 
-    if (query) {
+void editorGrep() {
+    struct editorGrep *g = &E.grep;
+    char *query = editorPrompt("Search files: %s (ESC to cancel)", NULL);
+    if (query == NULL || query[0] == '\0') {
+        if (g->query) g->active = 1;
         free(query);
-    } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        return;
+    }
+
+    editorGrepClear();
+    free(g->query);
+    g->query = query;
+    g->qlen = strlen(query);
+    __atomic_store_n(&g->cancel, 0, __ATOMIC_RELAXED);
+    g->active = 1;
+    g->start = editorNow();
+    g->nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (g->nthreads < 1) g->nthreads = 1;
+    if (g->nthreads > KILO_HL_MAX_THREADS) g->nthreads = KILO_HL_MAX_THREADS;
+
+    for (int i = 0; i < g->nthreads; i++) {
+        memset(&g->queues[i], 0, sizeof(struct grepQueue));
+        pthread_mutex_init(&g->queues[i].lock, NULL);
+    }
+    grepPush(&g->queues[0], strdup("d."));
+    for (int i = 0; i < g->nthreads; i++) {
+        if (pthread_create(&g->threads[i], NULL, grepWorker, &g->queues[i]) != 0) die("pthread_create");
+    }
+    g->running = 1;
+}
+
+/* Called from the input loop: redraws when new results have come in and
+ * reaps the workers once the walk is over. */
+void editorGrepPoll() {
+    struct editorGrep *g = &E.grep;
+    if (!g->active) return;
+    pthread_mutex_lock(&g->lock);
+    int n = g->nresults;
+    pthread_mutex_unlock(&g->lock);
+    if (g->running && __atomic_load_n(&g->pending, __ATOMIC_SEQ_CST) == 0) {
+        editorGrepStop();
+        g->elapsed = editorNow() - g->start;
+        E.redraw = 1;
+    }
+    if (n != g->shown) E.redraw = 1;
+}
+
+void editorGrepJump() {
+    struct editorGrep *g = &E.grep;
+    if (E.follow.enabled) {
+        editorSetStatusMessage("Can't switch files in follow mode");
+        return;
+    }
+    pthread_mutex_lock(&g->lock);
+    if (g->sel >= g->nresults) {
+        pthread_mutex_unlock(&g->lock);
+        return;
     }
+    struct grepResult r = g->results[g->sel];
+    char *path = strdup(r.path);
+    pthread_mutex_unlock(&g->lock);
+
+    editorBufferOpen(path[0] == '.' && path[1] == '/' ? path + 2 : path);
+    free(path);
+    E.cy = r.line - 1 < E.numrows ? r.line - 1 : 0;
+    E.cx = (E.cy < E.numrows && r.col <= E.row[E.cy].size) ? r.col : 0;
+    E.rowoff = E.cy - E.screenrows / 2;
+    if (E.rowoff < 0) E.rowoff = 0;
+    g->active = 0;
 }
 
 struct abuf {
@@ -690,7 +3359,7 @@ struct abuf {
 #define ABUF_INIT {NULL, 0}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+    char *new = editorRealloc(ab->b, ab->len + len);
 
     if (new == NULL) return;
     memcpy(&new[ab->len], s, len);
@@ -702,19 +3371,207 @@ void abFree(struct abuf *ab) {
     free(ab->b);
 }
 
+/* Segment counts depend on the screen width, so a resize recounts every
+ * row and drops the index; edits keep both up to date in editorUpdateRow. */
+void editorWrapSync() {
+    if (E.wrapcols == E.screencols) return;
+    for (int j = 0; j < E.numrows; j++) E.row[j].vlines = editorRowWrapCount(&E.row[j]);
+    E.vlines.valid = 0;
+    E.wrapcols = E.screencols;
+}
+
+/* Visual line of the cursor; *x is its column within that line. */
+long long editorWrapCursor(int *x) {
+    long long v = rowIndexOffset(&E.vlines, E.cy);
+    *x = 0;
+    if (E.cy < E.numrows) {
+        erow *row = &E.row[E.cy];
+        int rx = editorRowCxToRx(row, E.cx);
+        int segcol;
+        v += editorRowWrapSegment(row, rx, &segcol);
+        *x = rx - segcol;
+        if (*x >= E.screencols) *x = E.screencols - 1;
+    }
+    return v;
+}
+
+void editorWrapMoveCursor(int dir) {
+    editorWrapSync();
+    int x;
+    long long v = editorWrapCursor(&x) + dir;
+    if (v < 0) return;
+    if (v >= rowIndexOffset(&E.vlines, E.numrows)) {
+        if (E.cy < E.numrows) {
+            E.cy = E.numrows;
+            E.cx = 0;
+        }
+        return;
+    }
+
+    long long seg;
+    E.cy = rowIndexFind(&E.vlines, v, &seg);
+    erow *row = &E.row[E.cy];
+    int j = 0, col = 0, start = 0;
+    for (long long k = 0; k <= seg; k++) {
+        start = col;
+        j = editorRowWrapNext(row, j, &col);
+    }
+    int target = start + x;
+    if (target >= col && j < row->rsize) target = col - 1;
+    E.cx = editorRowRxToCx(row, target);
+}
+
+void editorWrapToggle() {
+    E.wrap = !E.wrap;
+    E.wrapoff = 0;
+    E.coloff = 0;
+    editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
 
+    if (E.wrap) {
+        editorWrapSync();
+        int x;
+        long long vcur = editorWrapCursor(&x);
+        long long vtop = rowIndexOffset(&E.vlines, E.rowoff) + E.wrapoff;
+        if (vcur < vtop) vtop = vcur;
+        if (vcur >= vtop + E.screenrows) vtop = vcur - E.screenrows + 1;
+        long long rest = 0;
+        E.rowoff = E.numrows ? rowIndexFind(&E.vlines, vtop, &rest) : 0;
+        E.wrapoff = rest;
+        E.coloff = 0;
+        return;
+    }
+
     if (E.cy < E.rowoff) E.rowoff = E.cy;
     if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
-    if (E.rx < E.coloff) E.coloff = E.cx;
-    if (E.rx >= E.coloff + E.screencols) E.coloff = E.cx - E.screencols + 1;
+    if (E.rx < E.coloff) E.coloff = E.rx;
+    if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+}
+
+/* Draws the row's render from offset j, which is at display column col,
+ * until the screen line is full; width is what is already used of it.
+ * Columns in [sel_lo, sel_hi) are drawn in reverse video. */
+void editorDrawRowFrom(struct abuf *ab, erow *row, int j, int col, int width,
+                       int sel_lo, int sel_hi) {
+    char *c = row->render;
+    unsigned char *hl = row->hl;
+    int colored = (row->hl_state != ROW_HL_PENDING);
+    int current_color = -1;
+    int selected = 0;
+
+    while (j < row->rsize) {
+        unsigned char b = c[j];
+        int len = row->cw ? row->cw[j] >> 2 : 1;
+        int w = row->cw ? row->cw[j] & 3 : 1;
+        if (width + w > E.screencols) break;
+        width += w;
+        if ((col >= sel_lo && col < sel_hi) != selected) {
+            selected = !selected;
+            abAppend(ab, selected ? "\x1b[7m" : "\x1b[27m", selected ? 4 : 5);
+        }
+        col += w;
+
+        if ((b < 0x80 && iscntrl(b)) || (b >= 0x80 && len == 1) ||
+            (b == 0xC2 && (unsigned char)c[j + 1] < 0xA0)) {
+            char sym = (b <= 26) ? '@' + b : '?';
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, &sym, 1);
+            abAppend(ab, "\x1b[m", 3);
+            if (selected) abAppend(ab, "\x1b[7m", 4);
+            if (current_color != -1) {
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                abAppend(ab, buf, clen);
+            }
+        } else if (!colored || hl[j] == HL_NORMAL) {
+            if (current_color != -1) {
+                abAppend(ab, "\x1b[39m", 5);
+                current_color = -1;
+            }
+            abAppend(ab, &c[j], len);
+        } else {
+            int color = editorSyntaxToColor(hl[j]);
+            if (color != current_color) {
+                current_color = color;
+                char buf [16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                abAppend(ab, buf, clen);
+            }
+            abAppend(ab, &c[j], len);
+        }
+        j += len;
+    }
+    if (j >= row->rsize && col >= sel_lo && col < sel_hi && width < E.screencols) {
+        if (!selected) abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, " ", 1);
+        selected = 1;
+    }
+    if (selected) abAppend(ab, "\x1b[27m", 5);
+    abAppend(ab, "\x1b[39m", 5);
+}
+
+void editorDrawRow(struct abuf *ab, erow *row, int sel_lo, int sel_hi) {
+    int j = 0;
+    int col = 0;
+    if (row->cw == NULL) {
+        j = col = (E.coloff < row->rsize) ? E.coloff : row->rsize;
+    } else {
+        while (j < row->rsize && col < E.coloff) {
+            col += row->cw[j] & 3;
+            j += row->cw[j] >> 2;
+        }
+    }
+    int width = col - E.coloff;
+    if (width > 0) abAppend(ab, " ", 1);
+    if (width < 0) width = 0;
+    editorDrawRowFrom(ab, row, j, col, width, sel_lo, sel_hi);
+}
+
+void editorDrawWrappedRows(struct abuf *ab) {
+    int filerow = E.rowoff;
+    int j = 0, col = 0;
+    if (filerow < E.numrows) {
+        for (int k = 0; k < E.wrapoff && filerow < E.numrows; k++) {
+            j = editorRowWrapNext(&E.row[filerow], j, &col);
+            if (j >= E.row[filerow].rsize) {
+                filerow++;
+                j = col = 0;
+            }
+        }
+    }
+
+    for (int y = 0; y < E.screenrows; y++) {
+        if (filerow >= E.numrows) {
+            abAppend(ab, "~", 1);
+        } else {
+            erow *row = &E.row[filerow];
+            int lo, hi;
+            editorRowSelection(filerow, &lo, &hi);
+            editorDrawRowFrom(ab, row, j, col, 0, lo, hi);
+            j = editorRowWrapNext(row, j, &col);
+            if (j >= row->rsize) {
+                filerow++;
+                j = col = 0;
+            }
+        }
+
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
 }
 
 void editorDrawRows(struct abuf *ab) {
+    if (E.wrap) {
+        editorDrawWrappedRows(ab);
+        return;
+    }
+
     int y;
     for (y = 0; y < E.screenrows; y++) {
         int filerow = y + E.rowoff;
@@ -735,59 +3592,117 @@ void editorDrawRows(struct abuf *ab) {
                 abAppend(ab, "~", 1);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf [16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5);
+            int lo, hi;
+            editorRowSelection(filerow, &lo, &hi);
+            editorDrawRow(ab, &E.row[filerow], lo, hi);
+        }
+
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+}
+
+void editorPagerDrawRows(struct abuf *ab) {
+    struct editorPager *p = &E.pager;
+    size_t off = p->top;
+    size_t cap = (size_t)(E.coloff + E.screencols) * 4 + 4;
+    for (int y = 0; y < E.screenrows; y++) {
+        if (off >= p->size) {
+            abAppend(ab, "~", 1);
+        } else {
+            size_t next = editorPagerNextLine(off);
+            size_t len = next - off;
+            if (len > 0 && p->map[next - 1] == '\n') len--;
+            if (len > 0 && p->map[off + len - 1] == '\r') len--;
+            if (len > cap) len = cap;
+
+            erow row = {0};
+            row.chars = &p->map[off];
+            row.size = len;
+            row.hl_state = ROW_HL_PENDING;
+            editorRenderRow(&row);
+            editorDrawRow(ab, &row, 0, 0);
+            free(row.render);
+            free(row.cw);
+            off = next;
+        }
+
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+}
+
+void editorGrepDrawRows(struct abuf *ab) {
+    struct editorGrep *g = &E.grep;
+    pthread_mutex_lock(&g->lock);
+    int n = g->nresults;
+    if (g->sel >= n) g->sel = n > 0 ? n - 1 : 0;
+    if (g->sel < g->top) g->top = g->sel;
+    if (g->sel >= g->top + E.screenrows) g->top = g->sel - E.screenrows + 1;
+
+    for (int y = 0; y < E.screenrows; y++) {
+        int i = g->top + y;
+        if (i >= n) {
+            abAppend(ab, "~", 1);
+        } else {
+            struct grepResult *r = &g->results[i];
+            const char *path = (r->path[0] == '.' && r->path[1] == '/') ? r->path + 2 : r->path;
+            size_t len = strlen(path) + strlen(r->text) + 32;
+            char *line = editorMalloc(len);
+            erow row = {0};
+            row.chars = line;
+            row.size = snprintf(line, len, "%s %s:%d: %s", i == g->sel ? ">" : " ",
+                                path, r->line, r->text);
+            row.hl_state = ROW_HL_PENDING;
+            editorRenderRow(&row);
+            editorDrawRow(ab, &row, 0, 0);
+            free(row.render);
+            free(row.cw);
+            free(line);
         }
 
         abAppend(ab, "\x1b[K", 3);
         abAppend(ab, "\r\n", 2);
     }
+    g->shown = n;
+    pthread_mutex_unlock(&g->lock);
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
-
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+    int len, rlen;
+
+    if (E.grep.active) {
+        struct editorGrep *g = &E.grep;
+        pthread_mutex_lock(&g->lock);
+        int n = g->nresults;
+        pthread_mutex_unlock(&g->lock);
+        len = snprintf(status, sizeof(status), "grep: %.20s - %d matches in %d files",
+                       g->query, n, __atomic_load_n(&g->files, __ATOMIC_RELAXED));
+        if (g->running) rlen = snprintf(rstatus, sizeof(rstatus), "searching...");
+        else rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d | %.1f ms",
+                             n ? g->sel + 1 : 0, n, g->elapsed / 1e6);
+    } else if (E.pager.enabled) {
+        struct editorPager *p = &E.pager;
+        long long line = editorPagerLineOf(p->top);
+        len = snprintf(status, sizeof(status), "%.20s - %lld lines%s [RO]",
+                       E.filename, p->lines, p->done ? "" : "+");
+        if (line < 0) rlen = snprintf(rstatus, sizeof(rstatus), "indexing %d%%",
+                                      (int)(p->indexed * 100 / p->size));
+        else rlen = snprintf(rstatus, sizeof(rstatus), "%lld/%lld%s", line + 1,
+                             p->lines, p->done ? "" : "+");
+    } else {
+        len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                        E.filename ? E.filename : "[No Name]", E.numrows,
                        E.dirty ? "(modified)": "");
-
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+        if (E.nbuffers > 1 && len < (int)sizeof(status))
+            len += snprintf(&status[len], sizeof(status) - len, "%s[%d/%d]",
+                            E.dirty ? " " : "", E.current + 1, E.nbuffers);
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | byte %lld",
+                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows,
+                        rowIndexOffset(&E.bytes, E.cy) + E.cx);
+    }
 
     if (len > E.screencols) len = E.screencols;
     abAppend(ab, status, len);
@@ -808,31 +3723,43 @@ void editorDrawStatusBar(struct abuf *ab) {
 
 void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
+    int msglen = utf8ClipWidth(E.statusmsg, strlen(E.statusmsg), E.screencols);
     if (msglen && time(NULL) - E.statusmsg_time < 5) abAppend(ab, E.statusmsg, msglen);
 }
 
 void editorRefreshScreen() {
-    editorScroll();
+    int overlay = E.pager.enabled || E.grep.active;
+    if (!overlay) editorScroll();
 
     struct abuf ab = ABUF_INIT;
 
     abAppend(&ab, "\x1b[?25l", 6);
     abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
+    if (E.grep.active) editorGrepDrawRows(&ab);
+    else if (E.pager.enabled) editorPagerDrawRows(&ab);
+    else editorDrawRows(&ab);
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1);
+    if (overlay) {
+        snprintf(buf, sizeof(buf), "\x1b[H");
+    } else if (E.wrap) {
+        int x;
+        long long y = editorWrapCursor(&x) - rowIndexOffset(&E.vlines, E.rowoff) - E.wrapoff;
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)y + 1, x + 1);
+    } else {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+                                                  (E.rx - E.coloff) + 1);
+    }
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
+    editorWrite(ab.b, ab.len);
+    E.stats.frames++;
+    if (E.stats.enabled) histRecord(&E.stats.hist[STAT_FRAME_BYTES], ab.len);
     abFree(&ab);
 }
 
@@ -846,7 +3773,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+    char *buf = editorMalloc(bufsize);
 
     size_t buflen = 0;
     buf[0] = '\0';
@@ -857,7 +3784,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
         int c = editorReadKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
+            if (buflen != 0) {
+                buflen = utf8PrevChar(buf, buflen);
+                buf[buflen] = '\0';
+            }
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
             if (callback) callback(buf, c);
@@ -869,10 +3799,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
                 if (callback) callback(buf, c);
                 return buf;
             }
-        } else if (!iscntrl(c) && c < 128) {
+        } else if (c < 256 && (c >= 128 || !iscntrl(c))) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                buf = editorRealloc(buf, bufsize);
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
@@ -882,13 +3812,35 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
 }
 
+void editorShowStats() {
+    if (!E.stats.enabled) {
+        editorSetStatusMessage("Instrumentation is off (start kilo with -i <file>)");
+        return;
+    }
+
+    struct histogram *h = E.stats.hist;
+    char k50[16], k99[16], syn[16], find[16], save[16];
+    editorSetStatusMessage("key p50 %s p99 %s | syntax p99 %s | find p99 %s | "
+                           "save p99 %s | frame p50 %lldB | malloc %lld realloc %lld",
+                           formatNs(k50, sizeof(k50), &h[STAT_KEY], 50),
+                           formatNs(k99, sizeof(k99), &h[STAT_KEY], 99),
+                           formatNs(syn, sizeof(syn), &h[STAT_SYNTAX], 99),
+                           formatNs(find, sizeof(find), &h[STAT_FIND], 99),
+                           formatNs(save, sizeof(save), &h[STAT_SAVE], 99),
+                           histPercentile(&h[STAT_FRAME_BYTES], 50),
+                           E.stats.mallocs, E.stats.reallocs);
+}
+
 void editorMoveCursor(int key) {
     erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    if (E.cx > (row ? row->size : 0)) E.cx = row ? row->size : 0;
 
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) {
-                E.cx--;
+                do {
+                    E.cx = utf8PrevChar(row->chars, E.cx);
+                } while (E.cx > 0 && editorRowIsCombining(row, E.cx));
             } else if (E.cy > 0) {
                 E.cy--;
                 E.cx = E.row[E.cy].size;
@@ -896,17 +3848,23 @@ void editorMoveCursor(int key) {
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size) {
-                E.cx++;
+                do {
+                    E.cx = utf8NextChar(row->chars, row->size, E.cx);
+                } while (E.cx < row->size && editorRowIsCombining(row, E.cx));
             } else if (row && E.cx == row->size) {
                 E.cy++;
                 E.cx = 0;
             }
             break;
         case ARROW_UP:
-            if (E.cy != 0) E.cy--;
-            break;
         case ARROW_DOWN:
-            if (E.cy < E.numrows) E.cy++;
+            if (E.wrap) {
+                editorWrapMoveCursor(key == ARROW_UP ? -1 : 1);
+            } else if (key == ARROW_UP ? E.cy != 0 : E.cy < E.numrows) {
+                int rx = row ? editorRowCxToRx(row, E.cx) : 0;
+                E.cy += (key == ARROW_UP) ? -1 : 1;
+                if (E.cy < E.numrows) E.cx = editorRowRxToCx(&E.row[E.cy], rx);
+            }
             break;
     }
 
@@ -915,24 +3873,184 @@ void editorMoveCursor(int key) {
     if (E.cx > rowlen) E.cx = rowlen;
 }
 
+void editorPagerSearch() {
+    struct editorPager *p = &E.pager;
+    size_t m = strlen(p->query);
+    size_t from = editorPagerNextLine(p->top);
+    char *match = editorMemFind(&p->map[from], p->size - from, p->query, m);
+    if (match == NULL) match = editorMemFind(p->map, from, p->query, m);
+    if (match == NULL) {
+        editorSetStatusMessage("Not found: %s", p->query);
+        return;
+    }
+    p->top = editorPagerLineBegin(match - p->map);
+    E.coloff = 0;
+    long long line = editorPagerLineOf(p->top);
+    if (line >= 0) editorSetStatusMessage("Found at line %lld", line + 1);
+    else editorSetStatusMessage("Found at byte %zu", (size_t)(match - p->map));
+}
+
+void editorPagerProcessKey(int c) {
+    struct editorPager *p = &E.pager;
+    int times = E.screenrows;
+    char *input;
+
+    switch (c) {
+        case 'q':
+        case CTRL_KEY('q'):
+            editorWrite("\x1b[2J", 4);
+            editorWrite("\x1b[H", 3);
+            exit(0);
+            break;
+
+        case ARROW_DOWN:
+        case 'j':
+        case '\r':
+            times = 1;
+            /* fall through */
+        case PAGE_DOWN:
+        case ' ':
+            while (times--) {
+                size_t next = editorPagerNextLine(p->top);
+                if (next >= p->size) break;
+                p->top = next;
+            }
+            break;
+
+        case ARROW_UP:
+        case 'k':
+            times = 1;
+            /* fall through */
+        case PAGE_UP:
+            while (times--) p->top = editorPagerPrevLine(p->top);
+            break;
+
+        case ARROW_LEFT:
+            if (E.coloff > 0) E.coloff--;
+            break;
+        case ARROW_RIGHT:
+            E.coloff++;
+            break;
+
+        case HOME_KEY:
+        case 'g':
+            p->top = 0;
+            E.coloff = 0;
+            break;
+        case END_KEY:
+        case 'G':
+            p->top = p->size;
+            while (times--) p->top = editorPagerPrevLine(p->top);
+            break;
+
+        case CTRL_KEY('g'):
+            input = editorPrompt("Go to line: %s (ESC to cancel)", NULL);
+            if (input == NULL) break;
+            long long line = atoll(input) - 1;
+            free(input);
+            if (line < 0) line = 0;
+            if (p->done && line >= p->lines) line = p->lines - 1;
+            long long off = editorPagerLineStart(line);
+            if (off < 0) {
+                editorSetStatusMessage("Line %lld is not indexed yet (%lld lines so far)",
+                                       line + 1, p->lines);
+                break;
+            }
+            p->top = off;
+            E.coloff = 0;
+            break;
+
+        case CTRL_KEY('f'):
+        case '/':
+            input = editorPrompt("Search: %s (ESC to cancel)", NULL);
+            if (input == NULL) break;
+            free(p->query);
+            p->query = input;
+            /* fall through */
+        case 'n':
+            if (p->query && p->size > 0) editorPagerSearch();
+            break;
+
+        default:
+            editorSetStatusMessage("Read-only: q = quit | / = search | n = next | Ctrl-G = go to line");
+            break;
+    }
+}
+
+void editorGrepProcessKey(int c) {
+    struct editorGrep *g = &E.grep;
+    int times = E.screenrows;
+
+    switch (c) {
+        case '\r':
+            editorGrepJump();
+            break;
+
+        case 'q':
+        case '\x1b':
+        case CTRL_KEY('q'):
+            editorGrepStop();
+            g->active = 0;
+            break;
+
+        case CTRL_KEY('p'):
+            editorGrep();
+            break;
+
+        case ARROW_UP:
+            times = 1;
+            /* fall through */
+        case PAGE_UP:
+            g->sel -= times;
+            if (g->sel < 0) g->sel = 0;
+            break;
+
+        case ARROW_DOWN:
+            times = 1;
+            /* fall through */
+        case PAGE_DOWN:
+            g->sel += times;
+            break;
+
+        case HOME_KEY:
+            g->sel = 0;
+            break;
+        case END_KEY:
+            g->sel = INT_MAX;
+            break;
+    }
+}
+
 void editorProcessKeypress() {
     static int quit_times = KILO_QUIT_TIMES;
 
     int c = editorReadKey();
+    if (E.pager.enabled) {
+        editorPagerProcessKey(c);
+        return;
+    }
+    if (E.grep.active) {
+        editorGrepProcessKey(c);
+        return;
+    }
+    E.undo.group++;
+    if (E.block.active && editorBlockKey(c)) return;
     switch (c) {
         case '\r':
             editorInsertNewLine();
             break;
 
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
-                editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                                       "Press Ctrl-Q %d more times to quit.", quit_times);
+            if (editorBuffersDirty() && quit_times > 0) {
+                editorSetStatusMessage("WARNING!!! %d file(s) have unsaved changes. "
+                                       "Press Ctrl-Q %d more times to quit.",
+                                       editorBuffersDirty(), quit_times);
                 quit_times--;
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            editorWrite("\x1b[2J", 4);
+            editorWrite("\x1b[H", 3);
+            editorBufferCloseAll();
             exit(0);
             break;
 
@@ -952,6 +4070,60 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('p'):
+            editorGrep();
+            break;
+
+        case CTRL_KEY('o'):
+            editorBufferPrompt();
+            break;
+
+        case CTRL_KEY('n'):
+            if (E.nbuffers > 1) editorBufferSwitch((E.current + 1) % E.nbuffers);
+            break;
+
+        case CTRL_KEY('w'):
+            editorWrapToggle();
+            break;
+
+        case CTRL_KEY('b'):
+            editorBlockToggle();
+            break;
+
+        case CTRL_KEY(' '):
+            editorMarkToggle();
+            break;
+
+        case CTRL_KEY('x'):
+        case CTRL_KEY('c'):
+            editorKillRegion(c == CTRL_KEY('x'));
+            break;
+
+        case CTRL_KEY('v'):
+        case CTRL_KEY('k'):
+            editorKillPaste(c == CTRL_KEY('k'));
+            break;
+
+        case CTRL_KEY('t'):
+            editorShowStats();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndoGroup(1);
+            break;
+
+        case CTRL_KEY('y'):
+            editorUndoGroup(0);
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -962,9 +4134,9 @@ void editorProcessKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             {
-                if (c == PAGE_UP) {
+                if (c == PAGE_UP && !E.wrap) {
                     E.cy = E.rowoff;
-                } else if (c == PAGE_DOWN) {
+                } else if (c == PAGE_DOWN && !E.wrap) {
                     E.cy = E.rowoff + E.screenrows - 1;
                     if (E.cy > E.numrows) E.cy = E.numrows;
                 }
@@ -983,17 +4155,39 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('l'):
+            break;
+
         case '\x1b':
+            E.mark.active = 0;
             break;
 
         default:
-            editorInsertChar(c);
+            if (c >= 0x80 && c < 0x100) {
+                char buf[4];
+                int n = editorReadUtf8(c, buf);
+                if (n) editorInsertText(buf, n);
+            } else {
+                editorInsertChar(c);
+            }
             break;
     }
 
     quit_times = KILO_QUIT_TIMES;
 }
 
+void editorHandleWinch(int sig) {
+    (void)sig;
+    E.resized = 1;
+}
+
+void editorHandleResize() {
+    E.resized = 0;
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1) return;
+    E.screenrows -= 2;
+    if (E.screenrows < 1) E.screenrows = 1;
+    E.redraw = 1;
+}
+
 void initEditor() {
     E.cx = 0;
     E.cy = 0;
@@ -1001,23 +4195,104 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
+    E.rowcap = 0;
     E.row = NULL;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die ("getWindowSize");
+    E.lock_waiters = 0;
+    E.hl_next = 0;
+    E.redraw = 0;
+    E.bytes.metric = editorRowBytes;
+    E.vlines.metric = editorRowVisualLines;
+    E.kill.yank_group = -1;
+    E.current = editorBufferNew();
+
+    pthread_mutex_init(&E.lock, NULL);
+    pthread_cond_init(&E.hl_cond, NULL);
+    pthread_mutex_init(&E.grep.lock, NULL);
+    editorLock();
+    if (pthread_create(&E.hl_thread, NULL, editorHighlightThread, NULL) != 0) die("pthread_create");
+
+    if (!E.headless && getWindowSize(&E.screenrows, &E.screencols) == -1) die ("getWindowSize");
+    if (!E.headless) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = editorHandleWinch;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, NULL);
+    }
     E.screenrows -= 2;
 }
 
+void usage() {
+    fprintf(stderr, "Usage: kilo [-f | -R] [-b keyscript] [-s ROWSxCOLS] [-i statsfile] "
+                    "[-j swapms] [-m cachemb] [file]\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    enableRawMode();
+    int opt;
+    E.infd = STDIN_FILENO;
+    E.screenrows = 24;
+    E.screencols = 80;
+    E.bench.start = editorNow();
+    E.swap.fd = -1;
+    E.swap.interval = KILO_SWAP_INTERVAL;
+    E.cache_budget = (size_t)KILO_CACHE_BUDGET << 20;
+
+    while ((opt = getopt(argc, argv, "fRb:s:i:j:m:")) != -1) {
+        switch (opt) {
+            case 'b':
+                E.headless = 1;
+                E.stats.enabled = 1;
+                E.infd = open(optarg, O_RDONLY);
+                if (E.infd == -1) die("open");
+                break;
+            case 'i':
+                E.stats.enabled = 1;
+                E.stats.dumpfile = optarg;
+                atexit(editorStatsAtExit);
+                break;
+            case 'f':
+                E.follow.enabled = 1;
+                break;
+            case 'R':
+                E.pager.enabled = 1;
+                break;
+            case 'j':
+                E.swap.interval = atoi(optarg);
+                break;
+            case 'm':
+                E.cache_budget = (size_t)atoi(optarg) << 20;
+                break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &E.screenrows, &E.screencols) != 2 ||
+                    E.screenrows < 3 || E.screencols < 1) usage();
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if ((E.follow.enabled || E.pager.enabled) && optind >= argc) usage();
+    if (E.follow.enabled && E.pager.enabled) usage();
+
+    if (!E.headless) enableRawMode();
     initEditor();
-    if (argc >= 2) editorOpen(argv[1]);
+    if (E.pager.enabled) {
+        if (editorPagerOpen(argv[optind]) == -1) die("open");
+    } else if (optind < argc) {
+        editorOpen(argv[optind]);
+    }
+    if (E.follow.enabled) editorFollowStart();
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    if (E.pager.enabled)
+        editorSetStatusMessage("HELP: q = quit | / = search | n = next | Ctrl-G = go to line");
+    else
+        editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace | Ctrl-P = grep | Ctrl-O/N = open/next | Ctrl-W = wrap | Ctrl-B = block | Ctrl-Space/X/C/V = mark/cut/copy/paste | Ctrl-G = go to | Ctrl-Z/Y = undo/redo | Ctrl-T = stats");
 
     while (1) {
         editorRefreshScreen();